@@ -2,3 +2,9 @@ all:
 	make
 	make -f test_server.mk
 	make -f test_client.mk
+
+bench:
+	make
+	make -f bench_server.mk
+	make -f bench_client.mk
+	make -f bench_buf.mk
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the message block code: cbuf_compose(),
+ * cbuf_decompose(), cbuf_getbuf() and cbuf_free(), for 1 to 3 parts of
+ * 0 to 8192 bytes each.  Prints one line per case: the operation, parts,
+ * bytes per part, ns per operation and malloc(3) calls per operation,
+ * i.e. misses of the block pool.  compose and decompose include freeing
+ * the block, as a message costs on the way out or in; free is also
+ * timed alone.  With -m the pool caches nothing, so every block comes
+ * from malloc(3).  A message too large for one datagram is composed as
+ * fragments and is not decomposed.  Empty parts are not sent, so getbuf
+ * is not timed for them.
+ */
+
+#include <sys/param.h>	/* nitems MIN */
+#include <sys/uio.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buf.h"
+
+#define	WARMUP		1000
+#define	BATCH		64	/* blocks freed per timing */
+
+struct cbuf_pool *pool;
+long		 iterations = 1000000;
+char		 payload[8192];
+char		 wire[CBUF_BUF_SIZE];
+size_t		 sizes[] = { 0, 64, 512, 2048, 8192 };
+
+__dead void	usage(void);
+double		 elapsed(struct timespec *);
+void		 report(const char *, int, size_t, double, u_int64_t);
+void		 bench(int, size_t);
+
+int
+main(int argc, char *argv[])
+{
+	const char *errstr;
+	unsigned int maxfree = 64;
+	unsigned int i;
+	int ch, parts;
+
+	while ((ch = getopt(argc, argv, "mn:")) != -1) {
+		switch (ch) {
+		case 'm':
+			maxfree = 0;
+			break;
+		case 'n':
+			iterations = strtonum(optarg, 1, LONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "iterations %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		usage();
+
+	memset(payload, 'x', sizeof(payload));
+	if ((pool = cbuf_pool_new(maxfree)) == NULL)
+		err(1, "cbuf_pool_new");
+	printf("%-10s %5s %6s %10s %10s\n", "op", "parts", "bytes", "ns/op",
+	    "allocs/op");
+	for (parts = 1; parts <= 3; parts++)
+		for (i = 0; i < nitems(sizes); i++)
+			bench(parts, sizes[i]);
+	cbuf_pool_free(pool);
+	return 0;
+}
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-m] [-n iterations]\n", __progname);
+	exit(1);
+}
+
+double
+elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+void
+report(const char *op, int parts, size_t len, double ns, u_int64_t miss)
+{
+	printf("%-10s %5d %6zu %10.1f %10.3f\n", op, parts, len,
+	    ns / iterations, (double)miss / iterations);
+}
+
+void
+bench(int parts, size_t len)
+{
+	struct iovec iov[3];
+	struct timespec t0;
+	struct cbuf *cbuf, *batch[BATCH];
+	u_int64_t miss;
+	size_t wlen = 0, l;
+	unsigned int i;
+	long j, k, n;
+	double ns;
+	void *volatile sink;
+
+	for (i = 0; i < (unsigned int)parts; i++) {
+		iov[i].iov_base = payload;
+		iov[i].iov_len = len;
+	}
+
+	/* compose and free, which is what sending a message costs */
+	for (n = 0; n < WARMUP; n++)
+		cbuf_free(cbuf_compose(pool, 1, 0, parts, iov));
+	miss = pool->stats.miss;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < iterations; n++) {
+		if ((cbuf = cbuf_compose(pool, 1, 0, parts, iov)) == NULL)
+			errx(1, "cbuf_compose");
+		cbuf_free(cbuf);
+	}
+	report("compose", parts, len, elapsed(&t0), pool->stats.miss - miss);
+
+	/* free alone, of batches composed off the clock */
+	for (n = 0, ns = 0; n < iterations; n += k) {
+		k = MIN(BATCH, iterations - n);
+		for (j = 0; j < k; j++)
+			if ((batch[j] = cbuf_compose(pool, 1, 0, parts,
+			    iov)) == NULL)
+				errx(1, "cbuf_compose");
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (j = 0; j < k; j++)
+			cbuf_free(batch[j]);
+		ns += elapsed(&t0);
+	}
+	report("free", parts, len, ns, 0);
+
+	/* getbuf, per part, on one message; empty parts are dropped */
+	cbuf = cbuf_compose(pool, 1, 0, parts, iov);
+	if (len > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (n = 0; n < iterations; n++)
+			sink = cbuf_getbuf(cbuf, &l, 1 + n % parts);
+		report("getbuf", parts, len, elapsed(&t0), 0);
+	}
+
+	/* the same message on the wire, if it goes in one datagram */
+	if ((cbuf->flags & CBUF_F_FRAG) == 0) {
+		for (i = 0; i < cbuf->iovlen; i++) {
+			memcpy(wire + wlen, cbuf->iov[i].iov_base,
+			    cbuf->iov[i].iov_len);
+			wlen += cbuf->iov[i].iov_len;
+		}
+	}
+	cbuf_free(cbuf);
+	if (wlen == 0)
+		return;
+
+	/* decompose and free, which is what receiving one costs */
+	for (n = 0; n < WARMUP; n++)
+		cbuf_free(cbuf_decompose(pool, wire, wlen));
+	miss = pool->stats.miss;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < iterations; n++) {
+		if ((cbuf = cbuf_decompose(pool, wire, wlen)) == NULL)
+			errx(1, "cbuf_decompose");
+		cbuf_free(cbuf);
+	}
+	report("decompose", parts, len, elapsed(&t0),
+	    pool->stats.miss - miss);
+
+	(void)sink;
+}
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Load generator for bench_server.  Opens -c sessions on one event loop
+ * and keeps -d requests in flight on each (1 for ping-pong) until -n
+ * requests per session are answered.  A request has -p parts of -l
+ * bytes; the first carries the time it was sent, which the echo brings
+ * back.  With -R, a single blocking session ping-pongs over shared
+ * memory rings instead.  The result goes to stdout as one JSON object,
+ * with the server's counters from ICTRL_T_STATS.
+ *
+ *	bench_server -w 4 &
+ *	bench_client -c 100 -d 8 -n 10000 -p 2 -l 256
+ */
+
+#include <sys/param.h>	/* MIN MAX */
+#include <sys/resource.h>
+
+#include <err.h>
+#include <event.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "ictrl.h"
+
+#define	BENCH_TYPE	1
+
+/*
+ * Latency histogram, HDR style: exact below 16 ns, then 16 buckets per
+ * power of two, i.e. to within 1/16 of the value.
+ */
+#define	HIST_SUBBITS	4
+#define	HIST_SUB	(1 << HIST_SUBBITS)
+#define	HIST_SIZE	((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+struct hist {
+	u_int64_t	 count[HIST_SIZE];
+	u_int64_t	 n;
+	u_int64_t	 min;
+	u_int64_t	 max;
+	double		 sum;
+};
+
+struct bench_session {
+	struct ictrl_session *c;
+	int		 sent;
+};
+
+struct ictrl_config config = {
+	.path = "/tmp/ictrl-bench.sock"
+};
+
+int		 nsessions = 1;
+int		 nrequests = 10000;
+int		 depth = 1;
+int		 nparts = 1;
+size_t		 partlen = 64;
+
+struct bench_session *sessions;
+int		 nconnected;
+u_int64_t	 total, ndone;
+struct iovec	 parts[CBUF_MAXPARTS];
+struct hist	 hist;
+struct timespec	 t0, t1;
+
+__dead void	usage(void);
+u_int64_t	now(void);
+void		hist_add(struct hist *, u_int64_t);
+u_int64_t	hist_value(int);
+u_int64_t	hist_pct(struct hist *, double);
+void		bench_status(struct ictrl_session *, int);
+void		bench_send(struct bench_session *);
+void		bench_done(struct ictrl_session *, struct cbuf *, void *);
+void		bench_async(void);
+void		bench_ring(void);
+void		report(void);
+void		report_server(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct rlimit rl;
+	const char *errstr;
+	int ch, i, ring = 0;
+
+	while ((ch = getopt(argc, argv, "c:d:l:n:p:qRs:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nsessions = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "sessions %s: %s", errstr, optarg);
+			break;
+		case 'd':
+			depth = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr != NULL)
+				errx(1, "depth %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			partlen = strtonum(optarg, sizeof(u_int64_t),
+			    ICTRL_MAXMSG, &errstr);
+			if (errstr != NULL)
+				errx(1, "length %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			nrequests = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "requests %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			nparts = strtonum(optarg, 1, CBUF_MAXPARTS, &errstr);
+			if (errstr != NULL)
+				errx(1, "parts %s: %s", errstr, optarg);
+			break;
+		case 'q':
+			config.flags |= ICTRL_F_REQID;
+			break;
+		case 'R':
+			config.flags |= ICTRL_F_RING;
+			ring = 1;
+			break;
+		case 's':
+			config.path = optarg;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		usage();
+	if (ring && (nsessions > 1 || depth > 1))
+		errx(1, "-R is one session, ping-pong");
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)nsessions + 16) {
+		rl.rlim_cur = MIN(rl.rlim_max, (rlim_t)nsessions + 16);
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < nparts; i++) {
+		if ((parts[i].iov_base = calloc(1, partlen)) == NULL)
+			err(1, "calloc");
+		parts[i].iov_len = partlen;
+	}
+	hist.min = UINT64_MAX;
+	total = (u_int64_t)nsessions * nrequests;
+
+	if (ring)
+		bench_ring();
+	else
+		bench_async();
+	report();
+	return 0;
+}
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-qR] [-c sessions] [-d depth] "
+	    "[-l length] [-n requests]\n"
+	    "       [-p parts] [-s socket]\n", __progname);
+	exit(1);
+}
+
+u_int64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+hist_add(struct hist *h, u_int64_t v)
+{
+	int e, i;
+
+	if (v < HIST_SUB)
+		i = v;
+	else {
+		e = 63 - __builtin_clzll(v);
+		i = (e - HIST_SUBBITS + 1) * HIST_SUB +
+		    ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+	}
+	h->count[i]++;
+	h->n++;
+	h->sum += v;
+	h->min = MIN(h->min, v);
+	h->max = MAX(h->max, v);
+}
+
+/* The lowest value of bucket i. */
+u_int64_t
+hist_value(int i)
+{
+	int e;
+
+	if (i < HIST_SUB)
+		return i;
+	e = i / HIST_SUB + HIST_SUBBITS - 1;
+	return (u_int64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUBBITS);
+}
+
+u_int64_t
+hist_pct(struct hist *h, double pct)
+{
+	u_int64_t want = (u_int64_t)(h->n * pct / 100.0), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_SIZE; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			return MIN(hist_value(i), h->max);
+	}
+	return h->max;
+}
+
+/*
+ * Many sessions on one loop.  Timing starts once all are connected.
+ */
+void
+bench_async(void)
+{
+	struct event_base *base;
+	int i;
+
+	base = event_init();
+	config.status = bench_status;
+	if ((sessions = calloc(nsessions, sizeof(*sessions))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nsessions; i++) {
+		if ((sessions[i].c = ictrl_client_open(&config, base)) == NULL)
+			errx(1, "session %d", i);
+	}
+	event_dispatch();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < nsessions; i++)
+		ictrl_client_close(sessions[i].c);
+}
+
+void
+bench_status(struct ictrl_session *c, int error)
+{
+	int i, j;
+
+	if (error != 0)
+		errx(1, "session: %s", strerror(error));
+	if (++nconnected < nsessions)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nsessions; i++)
+		for (j = 0; j < depth && j < nrequests; j++)
+			bench_send(&sessions[i]);
+}
+
+void
+bench_send(struct bench_session *bs)
+{
+	u_int64_t t = now();
+
+	memcpy(parts[0].iov_base, &t, sizeof(t));
+	if (ictrl_request(bs->c, BENCH_TYPE, nparts, parts, bench_done,
+	    bs) != 0)
+		errx(1, "request");
+	bs->sent++;
+}
+
+void
+bench_done(struct ictrl_session *c, struct cbuf *cbuf, void *arg)
+{
+	struct bench_session *bs = arg;
+	u_int64_t t;
+	size_t len;
+	void *p;
+
+	if (cbuf == NULL)
+		errx(1, "session closed");
+	if ((p = cbuf_getbuf(cbuf, &len, 1)) == NULL || len < sizeof(t))
+		errx(1, "short reply");
+	memcpy(&t, p, sizeof(t));
+	hist_add(&hist, now() - t);
+	cbuf_free(cbuf);
+
+	if (bs->sent < nrequests)
+		bench_send(bs);
+	if (++ndone == total)
+		event_loopbreak();
+}
+
+/*
+ * One blocking session, which may move onto rings.
+ */
+void
+bench_ring(void)
+{
+	struct ictrl_session *c;
+	struct cbuf *cbuf;
+	u_int64_t t;
+	size_t len;
+	void *p;
+	int i;
+
+	if ((c = ictrl_client_init(&config)) == NULL)
+		errx(1, "cannot connect to %s", config.path);
+	if (c->ring == NULL)
+		warnx("no rings; on the socket");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nrequests; i++) {
+		t = now();
+		memcpy(parts[0].iov_base, &t, sizeof(t));
+		if (ictrl_buildv(c, BENCH_TYPE, nparts, parts) != 0 ||
+		    ictrl_send(c) != 0 || (cbuf = ictrl_recv(c)) == NULL)
+			errx(1, "request %d", i);
+		if ((p = cbuf_getbuf(cbuf, &len, 1)) == NULL ||
+		    len < sizeof(t))
+			errx(1, "short reply");
+		memcpy(&t, p, sizeof(t));
+		hist_add(&hist, now() - t);
+		cbuf_free(cbuf);
+		ndone++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ictrl_client_fini(c);
+}
+
+void
+report(void)
+{
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double bytes = (double)ndone * nparts * partlen;
+	int i, first = 1;
+
+	printf("{\"sessions\": %d, \"depth\": %d, \"parts\": %d, "
+	    "\"length\": %zu, \"ring\": %d, \"requests\": %llu, "
+	    "\"seconds\": %.6f, \"msgs_per_sec\": %.0f, "
+	    "\"mbytes_per_sec\": %.2f,\n", nsessions, depth, nparts, partlen,
+	    (config.flags & ICTRL_F_RING) != 0, (unsigned long long)ndone,
+	    secs, ndone / secs, bytes / secs / (1024 * 1024));
+	printf(" \"latency_ns\": {\"min\": %llu, \"mean\": %.0f, "
+	    "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, "
+	    "\"max\": %llu},\n", (unsigned long long)hist.min,
+	    hist.sum / MAX(hist.n, 1),
+	    (unsigned long long)hist_pct(&hist, 50),
+	    (unsigned long long)hist_pct(&hist, 90),
+	    (unsigned long long)hist_pct(&hist, 99),
+	    (unsigned long long)hist_pct(&hist, 99.9),
+	    (unsigned long long)hist.max);
+	printf(" \"histogram\": [");
+	for (i = 0; i < HIST_SIZE; i++) {
+		if (hist.count[i] == 0)
+			continue;
+		printf("%s[%llu, %llu]", first ? "" : ", ",
+		    (unsigned long long)hist_value(i),
+		    (unsigned long long)hist.count[i]);
+		first = 0;
+	}
+	printf("],\n");
+	report_server();
+	printf("}\n");
+}
+
+/*
+ * The server's side of the story, over a session of its own.
+ */
+void
+report_server(void)
+{
+	struct ictrl_config cf = { .path = config.path };
+	struct ictrl_session *c;
+	struct ictrl_stats st;
+	struct cbuf *cbuf = NULL;
+	size_t len;
+	void *p;
+
+	if ((c = ictrl_client_init(&cf)) == NULL ||
+	    ictrl_build(c, ICTRL_T_STATS, NULL, 0) != 0 ||
+	    ictrl_send(c) != 0 || (cbuf = ictrl_recv(c)) == NULL ||
+	    (p = cbuf_getbuf(cbuf, &len, 1)) == NULL || len < sizeof(st)) {
+		printf(" \"server\": null\n");
+		goto out;
+	}
+	memcpy(&st, p, sizeof(st));
+	printf(" \"server\": {\"msgs_in\": %llu, \"msgs_out\": %llu, "
+	    "\"bytes_in\": %llu, \"bytes_out\": %llu, \"snd_full\": %llu, "
+	    "\"alloc_fail\": %llu, \"decode_fail\": %llu, "
+	    "\"ev_add\": %llu, \"ev_del\": %llu}\n",
+	    (unsigned long long)st.msgs_in, (unsigned long long)st.msgs_out,
+	    (unsigned long long)st.bytes_in, (unsigned long long)st.bytes_out,
+	    (unsigned long long)st.snd_full, (unsigned long long)st.alloc_fail,
+	    (unsigned long long)st.decode_fail,
+	    (unsigned long long)st.ev_add, (unsigned long long)st.ev_del);
+out:
+	if (cbuf != NULL)
+		cbuf_free(cbuf);
+	if (c != NULL)
+		ictrl_client_fini(c);
+}
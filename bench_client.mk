@@ -0,0 +1,12 @@
+PROG=	bench_client
+SRCS=	bench_client.c
+
+LDADD=	-L. -lictrl \
+	-levent \
+	-lpthread \
+	-lutil \
+
+NOMAN=	1
+NOLINT=	1
+
+.include <bsd.prog.mk>
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Echo server for bench_client.  Runs unprivileged in the foreground;
+ * on SIGINT or SIGTERM it prints its counters as JSON and exits.
+ */
+
+#include <sys/param.h>	/* MIN */
+#include <sys/resource.h>
+
+#include <err.h>
+#include <event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "ictrl.h"
+
+struct ictrl_config config = {
+	.path = "/tmp/ictrl-bench.sock",
+	.backlog = 128
+};
+
+__dead void	usage(void);
+void		bench_echo(struct ictrl_session *, struct cbuf *);
+void		bench_signal(int, short, void *);
+
+int
+main(int argc, char *argv[])
+{
+	struct ictrl_state *ctrl;
+	struct ictrl_stats st;
+	struct event ev_sigint, ev_sigterm;
+	struct rlimit rl;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "Rs:uw:z")) != -1) {
+		switch (ch) {
+		case 'R':
+			config.flags |= ICTRL_F_RING;
+			break;
+		case 's':
+			config.path = optarg;
+			break;
+		case 'u':
+			config.flags |= ICTRL_F_URING;
+			break;
+		case 'w':
+			config.nworkers = atoi(optarg);
+			break;
+		case 'z':
+			config.flags |= ICTRL_F_ZEROCOPY;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		usage();
+	config.proc = bench_echo;
+
+	/* One descriptor per session. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	event_init();
+	signal_set(&ev_sigint, SIGINT, bench_signal, NULL);
+	signal_set(&ev_sigterm, SIGTERM, bench_signal, NULL);
+	signal_add(&ev_sigint, NULL);
+	signal_add(&ev_sigterm, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((ctrl = ictrl_server_init(&config)) == NULL)
+		errx(1, "cannot listen on %s", config.path);
+	ictrl_server_start(ctrl);
+	event_dispatch();
+
+	ictrl_server_stats(ctrl, &st);
+	printf("{\"server\": {\"workers\": %d, \"msgs_in\": %llu, "
+	    "\"msgs_out\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+	    "\"accepts\": %llu, \"snd_full\": %llu, \"alloc_fail\": %llu, "
+	    "\"decode_fail\": %llu, \"ev_add\": %llu, \"ev_del\": %llu}}\n",
+	    config.nworkers,
+	    (unsigned long long)st.msgs_in, (unsigned long long)st.msgs_out,
+	    (unsigned long long)st.bytes_in, (unsigned long long)st.bytes_out,
+	    (unsigned long long)st.accepts, (unsigned long long)st.snd_full,
+	    (unsigned long long)st.alloc_fail,
+	    (unsigned long long)st.decode_fail,
+	    (unsigned long long)st.ev_add, (unsigned long long)st.ev_del);
+
+	ictrl_server_stop(ctrl);
+	ictrl_server_fini(ctrl);
+	return 0;
+}
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-Ruz] [-s socket] [-w workers]\n",
+	    __progname);
+	exit(1);
+}
+
+/*
+ * Send the parts back as they came, under the same type.
+ */
+void
+bench_echo(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct iovec iov[CBUF_MAXPARTS];
+	struct cbuf_msghdr *cmh = cbuf_getbuf(cbuf, NULL, 0);
+	unsigned int i, n = MIN(cbuf->iovlen - 1, CBUF_MAXPARTS);
+
+	for (i = 0; i < n; i++)
+		iov[i].iov_base = cbuf_getbuf(cbuf, &iov[i].iov_len, i + 1);
+	ictrl_buildv(c, cmh->type, n, iov);
+	cbuf_free(cbuf);
+}
+
+void
+bench_signal(int sig, short event, void *arg)
+{
+	event_loopbreak();
+}
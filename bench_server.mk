@@ -0,0 +1,12 @@
+PROG=	bench_server
+SRCS=	bench_server.c
+
+LDADD=	-L. -lictrl \
+	-levent \
+	-lpthread \
+	-lutil \
+
+NOMAN=	1
+NOLINT=	1
+
+.include <bsd.prog.mk>
@@ -16,14 +16,133 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/param.h>	/* nitems */
+#include <sys/param.h>	/* nitems MIN roundup */
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "buf.h"
 
+static const size_t cbuf_class_size[CBUF_POOL_NCLASS] = {
+	256, 1024, 4096, CBUF_BUF_SIZE
+};
+
+static void	cbuf_pool_rele(struct cbuf_pool *);
+static int	cbuf_class(size_t);
+static int	cbuf_iovec(struct cbuf *, unsigned int, size_t);
+static int	cbuf_vec(struct cbuf *, char *, size_t, size_t);
+
+struct cbuf_pool *
+cbuf_pool_new(unsigned int maxfree)
+{
+	struct cbuf_pool *pool;
+	int i;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL)
+		return NULL;
+	for (i = 0; i < CBUF_POOL_NCLASS; i++)
+		TAILQ_INIT(&pool->free[i]);
+	pool->maxfree = maxfree;
+	pool->refcnt = 1;
+	return pool;
+}
+
+/*
+ * Release the cached blocks and the owner's reference.  Blocks still
+ * out go to free(3) from now on; the last one frees the pool.
+ */
+void
+cbuf_pool_free(struct cbuf_pool *pool)
+{
+	struct cbuf *cbuf;
+	int i;
+
+	for (i = 0; i < CBUF_POOL_NCLASS; i++) {
+		while ((cbuf = TAILQ_FIRST(&pool->free[i]))) {
+			TAILQ_REMOVE(&pool->free[i], cbuf, entry);
+			free(cbuf);
+		}
+		pool->nfree[i] = 0;
+	}
+	pool->maxfree = 0;
+	cbuf_pool_rele(pool);
+}
+
+static void
+cbuf_pool_rele(struct cbuf_pool *pool)
+{
+	if (--pool->refcnt == 0)
+		free(pool);
+}
+
+static int
+cbuf_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < CBUF_POOL_NCLASS; i++)
+		if (size <= cbuf_class_size[i])
+			return i;
+	return -1;
+}
+
+/*
+ * Get a single-block cbuf with at least size bytes of data[].
+ */
+struct cbuf *
+cbuf_get(struct cbuf_pool *pool, size_t size)
+{
+	struct cbuf *cbuf;
+	int class;
+
+	class = cbuf_class(size);
+	if (class != -1)
+		size = cbuf_class_size[class];
+
+	if (pool != NULL) {
+		pool->stats.get++;
+		if (class != -1 &&
+		    (cbuf = TAILQ_FIRST(&pool->free[class])) != NULL) {
+			TAILQ_REMOVE(&pool->free[class], cbuf, entry);
+			pool->nfree[class]--;
+			pool->stats.hit++;
+			goto init;
+		}
+		pool->stats.miss++;
+	}
+
+	if ((cbuf = malloc(sizeof(*cbuf) + size)) == NULL) {
+		if (pool != NULL)
+			pool->stats.fail++;
+		return NULL;
+	}
+	cbuf->size = size;
+
+init:
+	if (pool != NULL)
+		pool->refcnt++;
+	bzero(cbuf->iov0, sizeof(cbuf->iov0));
+	cbuf->iov = cbuf->iov0;
+	cbuf->iovlen = 0;
+	cbuf->iovmax = CBUF_MAXIOV;
+	cbuf->refcnt = 1;
+	cbuf->flags = 0;
+	cbuf->id = 0;
+	cbuf->frag = NULL;
+	cbuf->off = 0;
+	cbuf->len = 0;
+	cbuf->nfds = 0;
+	cbuf->ref = NULL;
+	cbuf->pool = pool;
+	cbuf->sclass = (pool != NULL) ? class : -1;
+	return cbuf;
+}
+
 struct cbuf *
 cbuf_new(void)
 {
@@ -31,9 +150,49 @@ cbuf_new(void)
 
 	if ((cbuf = calloc(1, sizeof(*cbuf))) == NULL)
 		return NULL;
+	cbuf->iov = cbuf->iov0;
+	cbuf->iovmax = CBUF_MAXIOV;
+	cbuf->refcnt = 1;
+	cbuf->flags = CBUF_F_SCATTER;
+	cbuf->sclass = -1;
 	return cbuf;
 }
 
+/*
+ * Make room for n iovs, keeping the ones set.  The new array goes in
+ * data[] past the first used bytes if it fits, or is malloc'ed.
+ */
+static int
+cbuf_iovec(struct cbuf *cbuf, unsigned int n, size_t used)
+{
+	struct iovec *iov;
+	size_t off;
+	unsigned int flags = 0;
+
+	if (n <= cbuf->iovmax)
+		return 0;
+	if (n > CBUF_MAXPARTS + 1)
+		return -1;
+
+	off = roundup(used, sizeof(void *));
+	if (off < cbuf->size && n <= (cbuf->size - off) / sizeof(*iov))
+		iov = (struct iovec *)(cbuf->data + off);
+	else {
+		if ((iov = reallocarray(NULL, n, sizeof(*iov))) == NULL)
+			return -1;
+		flags = CBUF_F_IOVEC;
+	}
+	memmove(iov, cbuf->iov, cbuf->iovlen * sizeof(*iov));
+	bzero(iov + cbuf->iovlen, (n - cbuf->iovlen) * sizeof(*iov));
+
+	if (cbuf->flags & CBUF_F_IOVEC)
+		free(cbuf->iov);
+	cbuf->flags = (cbuf->flags & ~CBUF_F_IOVEC) | flags;
+	cbuf->iov = iov;
+	cbuf->iovmax = n;
+	return 0;
+}
+
 void *
 cbuf_alloc(size_t len)
 {
@@ -57,7 +216,10 @@ cbuf_addbuf(struct cbuf *cbuf, void *buf, size_t len)
 		bzero((char *)buf + len, CBUF_ALIGN - (len & CBUF_MASK));
 		len = CBUF_LEN(len);
 	}
-	if (cbuf->iovlen >= nitems(cbuf->iov))
+	if (cbuf->iovlen >= cbuf->iovmax)
+		cbuf_iovec(cbuf, MIN(cbuf->iovmax * 2, CBUF_MAXPARTS + 1),
+		    cbuf->size);
+	if (cbuf->iovlen >= cbuf->iovmax)
 		return -1;
 	cbuf->iov[cbuf->iovlen].iov_base = buf;
 	cbuf->iov[cbuf->iovlen].iov_len = len;
@@ -70,7 +232,7 @@ cbuf_getbuf(struct cbuf *cbuf, size_t *len, unsigned int elm)
 {
 	if (len != NULL)
 		*len = 0;
-	if (elm >= nitems(cbuf->iov))
+	if (elm >= cbuf->iovlen)
 		return NULL;
 	if (cbuf->iov[elm].iov_base == 0)
 		return NULL;
@@ -79,105 +241,523 @@ cbuf_getbuf(struct cbuf *cbuf, size_t *len, unsigned int elm)
 	return cbuf->iov[elm].iov_base;
 }
 
+/*
+ * Copy a part out of the cbuf, for handlers that keep it after the
+ * cbuf (and so the receive buffer under it) is freed.  Release with
+ * free(3).
+ */
+void *
+cbuf_detach(struct cbuf *cbuf, size_t *len, unsigned int elm)
+{
+	void *buf;
+	size_t n;
+
+	if ((buf = cbuf_getbuf(cbuf, &n, elm)) == NULL) {
+		if (len != NULL)
+			*len = 0;
+		return NULL;
+	}
+	if ((buf = cbuf_dup(buf, n)) == NULL)
+		n = 0;
+	if (len != NULL)
+		*len = n;
+	return buf;
+}
+
+/*
+ * Attach descriptor fd to the cbuf, which owns it from then on.
+ */
+int
+cbuf_addfd(struct cbuf *cbuf, int fd)
+{
+	if (cbuf->nfds >= nitems(cbuf->fds))
+		return -1;
+	cbuf->fds[cbuf->nfds++] = fd;
+	return 0;
+}
+
+/*
+ * Claim descriptor elm; the caller is to close it.  Returns -1 if there
+ * is none or it was claimed already.
+ */
+int
+cbuf_getfd(struct cbuf *cbuf, unsigned int elm)
+{
+	int fd;
+
+	if (elm >= cbuf->nfds)
+		return -1;
+	fd = cbuf->fds[elm];
+	cbuf->fds[elm] = -1;
+	return fd;
+}
+
+/*
+ * Bulk payloads.  cbuf_memcreate() makes an anonymous shared memory
+ * object of len bytes and maps it for writing.  The caller fills it,
+ * unmaps it and seals it with cbuf_memseal() before passing the
+ * descriptor on.  The peer maps it with cbuf_memmap(), which refuses
+ * an object that can still be written or resized under it where the
+ * system has seals.  Nothing is copied on the way.
+ */
+void *
+cbuf_memcreate(size_t len, int *fdp)
+{
+	void *p;
+	int fd;
+#ifndef MFD_ALLOW_SEALING
+	char path[] = "/cbuf.XXXXXXXXXX";
+#endif
+
+#ifdef MFD_ALLOW_SEALING
+	fd = memfd_create("cbuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	if ((fd = shm_mkstemp(path)) != -1)
+		shm_unlink(path);
+#endif
+	if (fd == -1)
+		return NULL;
+	if (ftruncate(fd, len) == -1 ||
+	    (p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	*fdp = fd;
+	return p;
+}
+
+int
+cbuf_memseal(int fd)
+{
+#ifdef F_ADD_SEALS
+	return fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#else
+	return 0;
+#endif
+}
+
+void *
+cbuf_memmap(int fd, size_t *lenp)
+{
+	struct stat st;
+	void *p;
+#ifdef F_GET_SEALS
+	int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+
+	if ((fcntl(fd, F_GET_SEALS) & seals) != seals)
+		return NULL;
+#endif
+
+	if (fstat(fd, &st) == -1 || st.st_size <= 0)
+		return NULL;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	*lenp = st.st_size;
+	return p;
+}
+
+struct cbuf *
+cbuf_ref(struct cbuf *cbuf)
+{
+	if (cbuf->flags & CBUF_F_SHARED)
+		__atomic_add_fetch(&cbuf->refcnt, 1, __ATOMIC_RELAXED);
+	else
+		cbuf->refcnt++;
+	return cbuf;
+}
+
+/*
+ * Get a view of the message in cbuf, for queueing one message on many
+ * sessions without copying it: the view has its own queue entry and
+ * send offset and points at the iovs of cbuf, which must not change
+ * any more.  cbuf is freed with its last view.  If views are freed by
+ * other threads, cbuf must be CBUF_F_SHARED and not pooled.
+ */
+struct cbuf *
+cbuf_view(struct cbuf_pool *pool, struct cbuf *cbuf)
+{
+	struct cbuf *view;
+
+	if ((view = cbuf_get(pool, 0)) == NULL)
+		return NULL;
+	view->flags = cbuf->flags & CBUF_F_FRAG;
+	view->iov = cbuf->iov;
+	view->iovlen = view->iovmax = cbuf->iovlen;
+	view->id = cbuf->id;
+	view->len = cbuf->len;
+	view->frag = cbuf->frag;
+	view->ref = cbuf_ref(cbuf);
+	return view;
+}
+
 void
 cbuf_free(struct cbuf *cbuf)
 {
+	struct cbuf_pool *pool = cbuf->pool;
 	unsigned int i;
 
-	for (i = 0; i < nitems(cbuf->iov); i++)
-		free(cbuf->iov[i].iov_base);
+	if (cbuf->flags & CBUF_F_SHARED) {
+		if (__atomic_sub_fetch(&cbuf->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+			return;
+	} else if (--cbuf->refcnt > 0)
+		return;
+
+	if (cbuf->ref != NULL)
+		cbuf_free(cbuf->ref);
+
+	if (cbuf->flags & CBUF_F_SCATTER)
+		for (i = 0; i < cbuf->iovlen; i++)
+			free(cbuf->iov[i].iov_base);
+	if (cbuf->flags & CBUF_F_IOVEC)
+		free(cbuf->iov);
+	for (i = 0; i < cbuf->nfds; i++)
+		if (cbuf->fds[i] != -1)
+			close(cbuf->fds[i]);
+
+	if (pool != NULL && cbuf->sclass != -1) {
+		if (pool->nfree[cbuf->sclass] < pool->maxfree) {
+			TAILQ_INSERT_HEAD(&pool->free[cbuf->sclass], cbuf,
+			    entry);
+			pool->nfree[cbuf->sclass]++;
+			pool->stats.put++;
+			cbuf_pool_rele(pool);
+			return;
+		}
+		pool->stats.drop++;
+	}
 	free(cbuf);
+	if (pool != NULL)
+		cbuf_pool_rele(pool);
 }
 
+/*
+ * Build a message of type from argc parts.  A non-zero id is carried
+ * in a header extension.  More than CBUF_BUF_NUM parts go in a part
+ * table.  A message too large for one datagram is built in fragmented
+ * form, to be cut up by cbuf_fragment().  A part with a NULL iov_base
+ * is only reserved, to be written in place through iov[].
+ */
 struct cbuf *
-cbuf_compose(int argc, struct iovec *argv)
+cbuf_compose(struct cbuf_pool *pool, u_int16_t type, u_int32_t id, int argc,
+    struct iovec *argv)
 {
 	struct cbuf *cbuf;
 	struct cbuf_msghdr *cmh;
-	size_t n = 0;
-	int i;
+	struct cbuf_msgfrag *frag = NULL;
+	struct cbuf_msgvec *vec = NULL;
+	char *ptr;
+	size_t hlen, tlen, n, room;
+	int i, fragmented = 0;
 
-	if (argc > (int)nitems(cmh->len))
+	if (argc < 0 || argc > CBUF_MAXPARTS)
 		return NULL;
-
-	for (i = 0; i < argc; i++)
-		n += argv[i].iov_len;
-	if (CBUF_LEN(n) > CBUF_BUF_SIZE - CBUF_LEN(sizeof(*cmh)))
+	if (type & CBUF_MSG_FLAGS)
 		return NULL;
 
-	if ((cbuf = cbuf_new()) == NULL)
-		return NULL;
-	if ((cmh = malloc(sizeof(*cmh))) == NULL)
-		goto fail;
-	bzero(cmh, sizeof(*cmh));
-	cbuf_addbuf(cbuf, cmh, sizeof(*cmh));
+	hlen = sizeof(*cmh);
+	if (id != 0)
+		hlen += sizeof(id);
+	hlen = CBUF_LEN(hlen);
 
+	n = 0;
 	for (i = 0; i < argc; i++) {
-		void *ptr;
+		if (argv[i].iov_len > UINT32_MAX)
+			return NULL;
+		n += CBUF_LEN(argv[i].iov_len);
+	}
+	tlen = sizeof(*vec) + argc * sizeof(vec->len[0]);
+	if (n + (argc > CBUF_BUF_NUM ? tlen : 0) > CBUF_BUF_SIZE - hlen) {
+		if (n + tlen > UINT32_MAX)
+			return NULL;
+		hlen += sizeof(*frag);
+		fragmented = 1;
+	} else if (argc <= CBUF_BUF_NUM)
+		tlen = 0;
+	n += hlen + tlen;
+
+	/* Room for the iovs past the message, if iov0[] is too small. */
+	room = 0;
+	if (argc + 1 > CBUF_MAXIOV)
+		room = sizeof(void *) + (argc + 1) * sizeof(struct iovec);
 
-		if (argv[i].iov_len <= 0)
+	if ((cbuf = cbuf_get(pool, n + room)) == NULL)
+		return NULL;
+	if (cbuf_iovec(cbuf, argc + 1, n) == -1) {
+		cbuf_free(cbuf);
+		return NULL;
+	}
+
+	ptr = cbuf->data;
+	cmh = (struct cbuf_msghdr *)ptr;
+	bzero(cmh, hlen);
+	cmh->type = type;
+	if (id != 0) {
+		cmh->type |= CBUF_MSG_ID;
+		memcpy(ptr + sizeof(*cmh), &id, sizeof(id));
+		cbuf->id = id;
+	}
+	if (fragmented) {
+		cmh->type |= CBUF_MSG_FRAG;
+		frag = (struct cbuf_msgfrag *)(ptr + hlen - sizeof(*frag));
+		frag->total = n - hlen;
+		cbuf->frag = frag;
+		cbuf->flags |= CBUF_F_FRAG;
+	}
+	if (tlen != 0) {
+		cmh->type |= CBUF_MSG_VEC;
+		vec = (struct cbuf_msgvec *)(ptr + hlen);
+		vec->nparts = argc;
+	}
+	/* iov[0] is the plain header; fragments carry the rest. */
+	cbuf_addbuf(cbuf, cmh, fragmented ? sizeof(*cmh) : hlen + tlen);
+	ptr += hlen + tlen;
+
+	for (i = 0; i < argc; i++) {
+		if (vec != NULL)
+			vec->len[i] = argv[i].iov_len;
+		else if (argv[i].iov_len <= 0)
 			continue;
-		cmh->len[i] = argv[i].iov_len;
-		if ((ptr = cbuf_alloc(argv[i].iov_len)) == NULL)
-			goto fail;
-		memcpy(ptr, argv[i].iov_base, argv[i].iov_len);
+		else
+			cmh->len[i] = argv[i].iov_len;
+		if (argv[i].iov_base != NULL)
+			memcpy(ptr, argv[i].iov_base, argv[i].iov_len);
 		cbuf_addbuf(cbuf, ptr, argv[i].iov_len);
+		ptr += CBUF_LEN(argv[i].iov_len);
 	}
 
 	return cbuf;
+}
+
+/*
+ * Cut the fragment of a fragmented cbuf that starts at body offset
+ * off.  The header goes to hdr, CBUF_FRAG_HDRMAX bytes; iov[0] and
+ * iov[1] are set to the header and the body slice.  Returns the length
+ * of the slice.
+ */
+size_t
+cbuf_fragment(struct cbuf *cbuf, size_t off, void *hdr, struct iovec *iov)
+{
+	struct cbuf_msgfrag *frag = cbuf->frag;
+	char *data = (cbuf->ref != NULL) ? cbuf->ref->data : cbuf->data;
+	size_t hlen, n;
+	u_int32_t offset = off;
+
+	hlen = (char *)(frag + 1) - data;
+	n = MIN(frag->total - off, CBUF_BUF_SIZE - hlen);
 
-fail:
-	cbuf_free(cbuf);
-	return NULL;
+	memcpy(hdr, data, hlen);
+	memcpy((char *)hdr + ((char *)&frag->offset - data), &offset,
+	    sizeof(offset));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = data + hlen + off;
+	iov[1].iov_len = n;
+	return n;
+}
+
+/*
+ * Add fragment frag to the message being reassembled in *rp, starting
+ * one if need be; frag itself is left alone, but for the descriptors,
+ * which come with the first fragment and move over.  Returns 1 when the
+ * message in *rp is complete, 0 if more fragments are due, or -1 if
+ * frag is out of sequence or the message would exceed max bytes.
+ */
+int
+cbuf_reasm(struct cbuf **rp, struct cbuf *frag, size_t max)
+{
+	struct cbuf_msgfrag *f = frag->frag, *rf;
+	struct cbuf_msghdr *cmh;
+	struct cbuf *r = *rp;
+	size_t hlen, n;
+
+	hlen = CBUF_LEN(sizeof(*cmh) + sizeof(*f));
+	if (r == NULL) {
+		if (f->offset != 0 || f->total > max)
+			return -1;
+		if ((r = cbuf_get(NULL, hlen + f->total)) == NULL)
+			return -1;
+		memcpy(r->data, frag->data, sizeof(*cmh));
+		rf = (struct cbuf_msgfrag *)(r->data + sizeof(*cmh));
+		memcpy(rf, f, sizeof(*rf));
+		r->frag = rf;
+		r->flags |= CBUF_F_FRAG;
+		r->id = frag->id;
+		memcpy(r->fds, frag->fds, sizeof(r->fds));
+		r->nfds = frag->nfds;
+		frag->nfds = 0;
+		*rp = r;
+	}
+
+	rf = r->frag;
+	n = frag->iov[1].iov_len;
+	if (f->offset != r->off || f->total != rf->total ||
+	    n > rf->total - r->off || frag->nfds != 0)
+		return -1;
+	memcpy(r->data + hlen + r->off, frag->iov[1].iov_base, n);
+	r->off += n;
+	if (r->off < rf->total)
+		return 0;
+
+	/* Complete; lay the parts out as in a regular message. */
+	cmh = (struct cbuf_msghdr *)r->data;
+	r->iov[0].iov_base = cmh;
+	r->iov[0].iov_len = sizeof(*cmh);
+	r->iovlen = 1;
+	r->len = 0;
+	r->flags &= ~CBUF_F_FRAG;
+	r->frag = NULL;
+	if (cbuf_vec(r, r->data + hlen, rf->total, hlen + rf->total) == -1)
+		return -1;
+	return 1;
 }
 
 struct cbuf *
-cbuf_decompose(char *buf, size_t len)
+cbuf_decompose(struct cbuf_pool *pool, char *buf, size_t len)
 {
 	struct cbuf *cbuf;
-	struct cbuf_msghdr *cmh;
-	size_t n;
-	int i;
 
-	if (len < sizeof(*cmh))
+	if (len < sizeof(struct cbuf_msghdr))
 		return NULL;
 
-	if ((cbuf = cbuf_new()) == NULL)
+	if ((cbuf = cbuf_get(pool, len)) == NULL)
 		return NULL;
 
+	/* One copy of the whole message; the parts are carved out below. */
+	memcpy(cbuf->data, buf, len);
+	if (cbuf_parse(cbuf, len) == -1) {
+		cbuf_free(cbuf);
+		return NULL;
+	}
+	return cbuf;
+}
+
+/*
+ * Set up the iovs of a cbuf whose data[] already holds a received
+ * message of len bytes.  The parts are views into data[]; nothing is
+ * copied.  Header extensions are consumed and stripped from the type,
+ * so iov[0] only ever covers the plain header.  For a fragment, iov[1]
+ * is its slice of the body and CBUF_F_FRAG is set.  The iovs of parts
+ * are padded; len is their total as sent.
+ */
+int
+cbuf_parse(struct cbuf *cbuf, size_t len)
+{
+	struct cbuf_msghdr *cmh;
+	char *ptr;
+	size_t n, used = len;
+	u_int16_t flags;
+	int i;
+
+	if (len < sizeof(*cmh) || len > cbuf->size)
+		return -1;
+
+	ptr = cbuf->data;
+
 	n = sizeof(*cmh);
-	cmh = cbuf_alloc(n);
-	memcpy(cmh, buf, n);
-	buf += n;
+	cmh = (struct cbuf_msghdr *)ptr;
+	if (cbuf->flags & CBUF_F_IOVEC)
+		free(cbuf->iov);
+	bzero(cbuf->iov0, sizeof(cbuf->iov0));
+	cbuf->iov = cbuf->iov0;
+	cbuf->iovmax = CBUF_MAXIOV;
+	cbuf->iov[0].iov_base = cmh;
+	cbuf->iov[0].iov_len = n;
+	cbuf->iovlen = 1;
+	cbuf->id = 0;
+	cbuf->len = 0;
+	cbuf->flags &= ~(CBUF_F_FRAG | CBUF_F_IOVEC);
+	cbuf->frag = NULL;
+
+	flags = cmh->type & CBUF_MSG_FLAGS;
+	if (flags & CBUF_MSG_ID) {
+		n += sizeof(cbuf->id);
+		if (len < n)
+			return -1;
+		memcpy(&cbuf->id, ptr + sizeof(*cmh), sizeof(cbuf->id));
+	}
+	if (flags & CBUF_MSG_FRAG) {
+		/* The part table is in the body, behind the fragments. */
+		if ((flags & CBUF_MSG_VEC) == 0)
+			return -1;
+		n += sizeof(struct cbuf_msgfrag);
+		if (len < n)
+			return -1;
+		cbuf->frag = (struct cbuf_msgfrag *)(ptr + n -
+		    sizeof(struct cbuf_msgfrag));
+	}
+	cmh->type &= ~CBUF_MSG_FLAGS;
+
+	n = CBUF_LEN(n);
+	ptr += n;
 	len -= n;
 
-	if (cbuf_addbuf(cbuf, cmh, n)) {
-		free(cmh);
-		goto fail;
+	if (cbuf->frag != NULL) {
+		if (cbuf->frag->offset > cbuf->frag->total ||
+		    len > cbuf->frag->total - cbuf->frag->offset)
+			return -1;
+		cbuf->iov[1].iov_base = ptr;
+		cbuf->iov[1].iov_len = len;
+		cbuf->iovlen = 2;
+		cbuf->off = cbuf->frag->offset;
+		cbuf->flags |= CBUF_F_FRAG;
+		return 0;
 	}
+	if (flags & CBUF_MSG_VEC)
+		return cbuf_vec(cbuf, ptr, len, used);
 
 	for (i = 0; i < nitems(cmh->len); i++) {
-		void *ptr;
-
 		n = cmh->len[i];
 		if (n == 0)
 			continue;
 		if (CBUF_LEN(n) > len)
-			goto fail;
-		if ((ptr = cbuf_alloc(n)) == NULL)
-			goto fail;
-		memcpy(ptr, buf, n);
-		if (cbuf_addbuf(cbuf, ptr, n)) {
-			free(ptr);
-			goto fail;
-		}
-		buf += CBUF_LEN(n);
+			return -1;
+		cbuf->iov[cbuf->iovlen].iov_base = ptr;
+		cbuf->iov[cbuf->iovlen].iov_len = CBUF_LEN(n);
+		cbuf->iovlen++;
+		cbuf->len += n;
+		ptr += CBUF_LEN(n);
 		len -= CBUF_LEN(n);
 	}
 
-	return cbuf;
+	return 0;
+}
+
+/*
+ * Lay out the parts of a body of len bytes at ptr that starts with a
+ * part table, after the header in iov[0].  The first used bytes of
+ * data[] are taken; the rest may hold the iovs.
+ */
+static int
+cbuf_vec(struct cbuf *cbuf, char *ptr, size_t len, size_t used)
+{
+	struct cbuf_msgvec *vec = (struct cbuf_msgvec *)ptr;
+	size_t n;
+	u_int32_t i;
+
+	if (len < sizeof(*vec) || vec->nparts > CBUF_MAXPARTS)
+		return -1;
+	n = sizeof(*vec) + vec->nparts * sizeof(vec->len[0]);
+	if (n > len)
+		return -1;
+	if (cbuf_iovec(cbuf, vec->nparts + 1, used) == -1)
+		return -1;
+	ptr += n;
+	len -= n;
 
-fail:
-	cbuf_free(cbuf);
-	return NULL;
+	for (i = 0; i < vec->nparts; i++) {
+		n = CBUF_LEN((size_t)vec->len[i]);
+		if (n > len)
+			return -1;
+		cbuf->iov[cbuf->iovlen].iov_base = ptr;
+		cbuf->iov[cbuf->iovlen].iov_len = n;
+		cbuf->iovlen++;
+		cbuf->len += vec->len[i];
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
 }
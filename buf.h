@@ -28,32 +28,146 @@
 #define CBUF_LEN(x)		((((x) + CBUF_MASK) / CBUF_ALIGN) * CBUF_ALIGN)
 #define CBUF_BUF_NUM		(CBUF_MAXIOV - 1/* cmh */)
 #define CBUF_BUF_SIZE		8192
+#define CBUF_MAXPARTS		1023	/* IOV_MAX less the header */
+#define CBUF_MAXFDS		8	/* descriptors per message */
 
+#define CBUF_POOL_NCLASS	4
+#define CBUF_POOL_MAXFREE	64
+
+struct cbuf_pool;
+
+/*
+ * A cbuf is normally a single block: the struct itself, followed by the
+ * message header and the aligned parts in data[].  The iovs point into
+ * data[].  Blocks come from size-classed free lists in a cbuf_pool and
+ * go back there on cbuf_free() once the last reference is dropped.
+ * The first CBUF_MAXIOV iovs live in iov0[]; a message with more parts
+ * keeps its iov array in the unused tail of data[], or in a malloc'ed
+ * one if there is no room.  Descriptors passed with the message are
+ * held in fds[] until claimed with cbuf_getfd(); cbuf_free() closes
+ * the rest.  A view, from cbuf_view(), has no data of its own and sends
+ * the message of ref.
+ */
 struct cbuf {
 	TAILQ_ENTRY(cbuf)	 entry;
-	struct iovec		 iov[CBUF_MAXIOV];
+	struct iovec		*iov;
 	unsigned int		 iovlen;
+	unsigned int		 iovmax;
+	unsigned int		 refcnt;
+	unsigned int		 flags;
+#define CBUF_F_SCATTER		0x01	/* parts are separately malloc'ed */
+#define CBUF_F_FRAG		0x02	/* fragmented; see frag */
+#define CBUF_F_IOVEC		0x04	/* iov is malloc'ed */
+#define CBUF_F_SHARED		0x08	/* refcnt is taken by other threads */
+	struct cbuf_pool	*pool;	/* owner; NULL if not pooled */
+	int			 sclass;	/* size class; -1 if none */
+	u_int32_t		 id;	/* request id; 0 if none */
+	size_t			 size;	/* size of data[] */
+	size_t			 len;	/* unpadded bytes of parts parsed */
+	struct cbuf_msgfrag	*frag;	/* fragment header in data[] */
+	size_t			 off;	/* body bytes sent or received */
+	int			 fds[CBUF_MAXFDS];
+	unsigned int		 nfds;
+	struct cbuf		*ref;	/* message viewed; NULL if none */
+	struct iovec		 iov0[CBUF_MAXIOV];
+	char			 data[];
 };
 TAILQ_HEAD(cbufq, cbuf);
 
+struct cbuf_pool_stats {
+	u_int64_t		 get;	/* blocks requested */
+	u_int64_t		 hit;	/* served from a free list */
+	u_int64_t		 miss;	/* served by malloc */
+	u_int64_t		 fail;	/* malloc failed */
+	u_int64_t		 put;	/* returned to a free list */
+	u_int64_t		 drop;	/* released to malloc */
+};
+
+/*
+ * Per-state block cache.  Not locked; a pool belongs to one event loop.
+ * Each block handed out holds a reference, so that it can still be
+ * freed after cbuf_pool_free(), which only drops the owner's; the pool
+ * goes with the last block.
+ */
+struct cbuf_pool {
+	struct cbufq		 free[CBUF_POOL_NCLASS];
+	unsigned int		 nfree[CBUF_POOL_NCLASS];
+	unsigned int		 maxfree;
+	unsigned int		 refcnt;	/* owner and blocks out */
+	struct cbuf_pool_stats	 stats;
+};
+
 /*
  * Common control message header.
- * A message can consist of up to 3 parts with specified length.
+ * A message can consist of up to 3 parts with specified length, or of
+ * up to CBUF_MAXPARTS with a part table.
+ * The high bits of type flag header extensions, which follow the
+ * header in the order of the bits.  Decoding strips them from type.
  */
 struct cbuf_msghdr {
 	u_int16_t	type;
 	u_int16_t	len[CBUF_BUF_NUM];
 };
 
+#define CBUF_MSG_ID		0x8000	/* u_int32_t request id */
+#define CBUF_MSG_FRAG		0x4000	/* struct cbuf_msgfrag */
+#define CBUF_MSG_VEC		0x2000	/* struct cbuf_msgvec */
+#define CBUF_MSG_FLAGS		0xe000	/* reserved for extensions */
+
+/*
+ * Part table, for messages with more than CBUF_BUF_NUM parts and for
+ * all fragmented ones.  It starts the body, in place of len[] of the
+ * header, and the aligned parts follow.  Lengths are 32 bits wide and
+ * empty parts keep their index.
+ */
+struct cbuf_msgvec {
+	u_int32_t	nparts;
+	u_int32_t	len[];
+};
+
+/*
+ * A message that does not fit in CBUF_BUF_SIZE is sent as a sequence
+ * of fragments.  Its body, the part table and the parts, is cut into
+ * pieces sent in order, each behind a copy of the header and this
+ * extension.
+ */
+struct cbuf_msgfrag {
+	u_int32_t	total;		/* body length */
+	u_int32_t	offset;		/* of this fragment in the body */
+};
+
+#define CBUF_FRAG_HDRMAX	CBUF_LEN(sizeof(struct cbuf_msghdr) +	\
+				    sizeof(u_int32_t) +			\
+				    sizeof(struct cbuf_msgfrag))
+
+struct cbuf_pool *
+		cbuf_pool_new(unsigned int);
+void	cbuf_pool_free(struct cbuf_pool *);
+struct cbuf *
+		cbuf_get(struct cbuf_pool *, size_t);
 struct cbuf *cbuf_new(void);
 void	*cbuf_alloc(size_t);
 void	*cbuf_dup(void *, size_t);
 int	cbuf_addbuf(struct cbuf *, void *, size_t);
 void	*cbuf_getbuf(struct cbuf *, size_t *, unsigned int);
+void	*cbuf_detach(struct cbuf *, size_t *, unsigned int);
+int	cbuf_addfd(struct cbuf *, int);
+int	cbuf_getfd(struct cbuf *, unsigned int);
+void	*cbuf_memcreate(size_t, int *);
+int	cbuf_memseal(int);
+void	*cbuf_memmap(int, size_t *);
+struct cbuf *
+		cbuf_ref(struct cbuf *);
+struct cbuf *
+		cbuf_view(struct cbuf_pool *, struct cbuf *);
 void	cbuf_free(struct cbuf *);
 struct cbuf *
-		cbuf_compose(int, struct iovec *);
+		cbuf_compose(struct cbuf_pool *, u_int16_t, u_int32_t, int,
+		    struct iovec *);
 struct cbuf *
-		cbuf_decompose(char *, size_t);
+		cbuf_decompose(struct cbuf_pool *, char *, size_t);
+int		cbuf_parse(struct cbuf *, size_t);
+size_t		cbuf_fragment(struct cbuf *, size_t, void *, struct iovec *);
+int		cbuf_reasm(struct cbuf **, struct cbuf *, size_t);
 
 #endif /* _ICTRL_BUF_H_ */
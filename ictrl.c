@@ -18,7 +18,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/param.h> /* nitems */
+#include <sys/param.h> /* nitems MIN */
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
@@ -28,18 +28,172 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "buf.h"
 #include "ictrl.h"
+#include "uring.h"
+
+/* uring user data of the accept; receives have their session's address */
+#define	ICTRL_UD_ACCEPT		1
+
+union ictrl_cmsgbuf;
+struct ictrl_handoff;
+struct ictrl_topic;
 
 static void	ictrl_server_accept(int, short, void *);
+static void	ictrl_server_take(struct ictrl_state *, int);
+static void	ictrl_server_uarm(struct ictrl_state *);
+static void	ictrl_server_uaccept(struct ictrl_state *,
+		    struct uring_event *);
+static void	ictrl_server_shed(struct ictrl_state *);
+static void	ictrl_server_resume(struct ictrl_state *);
+static int	ictrl_server_handoff(struct ictrl_state *, int);
+static struct ictrl_session *
+		ictrl_session_new(struct ictrl_worker *, int);
+static struct ictrl_session_cold *
+		ictrl_session_cold(struct ictrl_session *);
+static int	ictrl_worker_init(struct ictrl_worker *,
+		    struct ictrl_state *);
+static void	ictrl_worker_fini(struct ictrl_worker *);
+static int	ictrl_worker_start(struct ictrl_worker *);
+static void	ictrl_worker_stop(struct ictrl_worker *);
+static void	*ictrl_worker_main(void *);
+static void	ictrl_worker_handoff(int, short, void *);
+static void	ictrl_worker_ustart(struct ictrl_worker *);
+static void	ictrl_worker_ustop(struct ictrl_worker *);
+static void	ictrl_worker_reap(int, short, void *);
+static int	ictrl_wheel_start(struct ictrl_worker *);
+static void	ictrl_wheel_stop(struct ictrl_worker *);
+static void	ictrl_wheel_tick(int, short, void *);
+static int	ictrl_session_timo(struct ictrl_session *);
+static void	ictrl_session_touch(struct ictrl_session *);
+static struct ictrl_worker *
+		ictrl_worker_self(struct ictrl_state *);
+static void	ictrl_worker_post(struct ictrl_worker *,
+		    struct ictrl_handoff *);
+static void	ictrl_worker_view(struct ictrl_worker *,
+		    struct ictrl_session *, struct cbuf *);
+static int	ictrl_server_post(struct ictrl_state *, int, u_int32_t,
+		    u_int16_t, int, struct iovec *);
+static void	ictrl_event_set(struct ictrl_worker *, struct event *, int,
+		    short, void (*)(int, short, void *), void *);
+static int	ictrl_client_connect(struct ictrl_session *);
+static void	ictrl_client_retry(int, short, void *);
+static void	ictrl_client_dispatch(int, short, void *);
+static void	ictrl_client_reply(struct ictrl_session *, struct cbuf *);
+static void	ictrl_client_fail(struct ictrl_session *, int);
+static void	ictrl_client_free(struct ictrl_session *);
+static int	ictrl_room(struct ictrl_session *);
+static int	ictrl_enqueue(struct ictrl_session *, u_int16_t, u_int32_t,
+		    int, int, struct iovec *);
+static int	ictrl_reasm(struct ictrl_session *, struct cbuf **);
+static int	ictrl_fds(struct msghdr *, struct cbuf *);
+static void	ictrl_cmsg(struct msghdr *, union ictrl_cmsgbuf *,
+		    struct cbuf *);
+static void	ictrl_server_ring(struct ictrl_session *, struct cbuf *);
+static void	ictrl_server_sub(struct ictrl_session *, struct cbuf *);
+static void	ictrl_server_stat(struct ictrl_session *, struct cbuf *);
+static void	ictrl_server_proc(struct ictrl_session *, struct cbuf *,
+		    u_int16_t);
+static void	ictrl_server_error(struct ictrl_session *, struct cbuf *,
+		    u_int16_t, int);
+static struct ictrl_topic *
+		ictrl_topic_find(struct ictrl_worker *, u_int32_t);
+static int	ictrl_topic_add(struct ictrl_session *, u_int32_t);
+static void	ictrl_topic_del(struct ictrl_session *, struct ictrl_sub *);
+static int	ictrl_client_ring(struct ictrl_session *);
+static int	ictrl_client_ringed(struct ictrl_session *, struct cbuf *);
+static struct cbuf *
+		ictrl_sock_recv(struct ictrl_session *);
+static int	ictrl_ring_recvv(struct ictrl_session *, struct cbuf **, int);
+static int	ictrl_ring_send(struct ictrl_session *);
+static int	ictrl_ring_wait(struct ictrl_session *);
+
+/*
+ * A request waiting for its reply, in send order and, with
+ * ICTRL_F_REQID, hashed by id.
+ */
+struct ictrl_req {
+	TAILQ_ENTRY(ictrl_req)	 entry;
+	TAILQ_ENTRY(ictrl_req)	 hentry;
+	u_int32_t		 id;
+	void			(*done)(struct ictrl_session *, struct cbuf *,
+				    void *);
+	void			*arg;
+};
+
+/*
+ * A record on a worker's pipe: a connection to take on, a message to
+ * queue on all sessions or those subscribed to topic, or neither, to
+ * stop.
+ */
+struct ictrl_handoff {
+	int			 fd;
+	int			 all;
+	u_int32_t		 topic;
+	struct cbuf		*cbuf;	/* reference passed */
+};
+
+/*
+ * Topic index of a worker: topics hashed by number, each listing its
+ * subscriptions, so that a publish only walks the subscribers.  A
+ * session lists its own subscriptions too, for closing.
+ */
+struct ictrl_sub {
+	TAILQ_ENTRY(ictrl_sub)	 entry;		/* on topic */
+	TAILQ_ENTRY(ictrl_sub)	 sentry;	/* on session */
+	struct ictrl_topic	*topic;
+	struct ictrl_session	*session;
+};
+
+struct ictrl_topic {
+	LIST_ENTRY(ictrl_topic)	 entry;
+	u_int32_t		 topic;
+	TAILQ_HEAD(, ictrl_sub)	 subs;
+};
+LIST_HEAD(ictrl_topicq, ictrl_topic);
+
+/*
+ * Server sessions are allocated ICTRL_SLAB at a time, which keeps them
+ * dense, and recycled through the worker's free list.  The chunks are
+ * only released with the worker.
+ */
+struct ictrl_slab {
+	struct ictrl_slab	*next;
+	struct ictrl_session	 s[ICTRL_SLAB];
+};
+
+/* Control message space for the descriptors of one message. */
+union ictrl_cmsgbuf {
+	struct cmsghdr		 hdr;
+	char			 buf[CMSG_SPACE(CBUF_MAXFDS * sizeof(int))];
+};
 static void	ictrl_server_dispatch(int, short, void *);
+static void	ictrl_server_msg(struct ictrl_session *, struct cbuf *);
+static void	ictrl_server_flush(struct ictrl_session *);
+static int	ictrl_server_input(struct ictrl_session *, struct msghdr *,
+		    void *, size_t);
+static int	ictrl_session_read(struct ictrl_session *, int);
+static void	ictrl_session_urecv(struct ictrl_session *,
+		    struct uring_event *);
 static void	ictrl_server_close(struct ictrl_session *);
 static void	ictrl_server_trigger(struct ictrl_session *);
+static void	ictrl_server_wat(struct ictrl_session *);
+static void	ictrl_queue(struct ictrl_session *, struct cbuf *);
+static void	ictrl_dequeue(struct ictrl_session *, struct cbuf *);
+static void	ictrl_push(struct ictrl_session *, struct cbuf *);
+static void	ictrl_count_in(struct ictrl_session *, int, size_t);
+static void	ictrl_count_out(struct ictrl_session *, int, size_t);
+static int	ictrl_batch(int);
 
 /*
  * API for server
@@ -109,8 +263,53 @@ ictrl_server_init(struct ictrl_config *cf)
 	if ((flags = fcntl(fd, F_SETFL, flags)) == -1)
 		return NULL;
 
+	/*
+	 * Hold a spare descriptor to give back when we run out, so a
+	 * pending connection can still be accepted and shed.
+	 */
+	if ((ctrl->rfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		log_warn("%s: reserve fd", __func__);
+		close(fd);
+		(void)unlink(cf->path);
+		return NULL;
+	}
+
 	ctrl->config = cf;
 	ctrl->fd = fd;
+	if (ictrl_worker_init(&ctrl->worker, ctrl) == -1) {
+		log_warn("%s: pool", __func__);
+		close(ctrl->rfd);
+		close(fd);
+		(void)unlink(cf->path);
+		return NULL;
+	}
+
+	if (cf->nworkers > 0) {
+		int i;
+
+		if ((ctrl->workers = calloc(cf->nworkers,
+		    sizeof(*ctrl->workers))) == NULL) {
+			log_warn("%s: calloc", __func__);
+			ictrl_worker_fini(&ctrl->worker);
+			close(ctrl->rfd);
+			close(fd);
+			(void)unlink(cf->path);
+			return NULL;
+		}
+		for (i = 0; i < cf->nworkers; i++) {
+			if (ictrl_worker_init(&ctrl->workers[i], ctrl) == -1) {
+				log_warn("%s: pool", __func__);
+				while (i-- > 0)
+					ictrl_worker_fini(&ctrl->workers[i]);
+				free(ctrl->workers);
+				ictrl_worker_fini(&ctrl->worker);
+				close(ctrl->rfd);
+				close(fd);
+				(void)unlink(cf->path);
+				return NULL;
+			}
+		}
+	}
 
 	return ctrl;
 }
@@ -118,18 +317,59 @@ ictrl_server_init(struct ictrl_config *cf)
 void
 ictrl_server_fini(struct ictrl_state *ctrl)
 {
+	int i;
+
 	if (ctrl->config->path)
 		unlink(ctrl->config->path);
+	if (ctrl->rfd != -1)
+		close(ctrl->rfd);
 	close(ctrl->fd);
+	if (ctrl->workers != NULL) {
+		for (i = 0; i < ctrl->config->nworkers; i++)
+			ictrl_worker_fini(&ctrl->workers[i]);
+		free(ctrl->workers);
+	}
+	ictrl_worker_fini(&ctrl->worker);
+	free(ctrl->handlers);
 	free(ctrl);
 }
 
 void
 ictrl_server_start(struct ictrl_state *ctrl)
 {
-	event_set(&ctrl->ev, ctrl->fd, EV_READ, ictrl_server_accept, ctrl);
-	event_add(&ctrl->ev, NULL);
+	struct ictrl_worker *w;
+	int i;
+
+	if (ictrl_wheel_start(&ctrl->worker) == -1)
+		log_warn("%s: timer wheel", __func__);
+	/* Handlers are all registered by now; count their calls. */
+	for (i = -1; ctrl->nhandlers > 0 && i < ctrl->config->nworkers; i++) {
+		w = (i == -1) ? &ctrl->worker : &ctrl->workers[i];
+		if ((w->hstats = calloc(ctrl->nhandlers,
+		    sizeof(*w->hstats))) == NULL)
+			log_warn("%s: handler stats", __func__);
+		else
+			w->nhstats = ctrl->nhandlers;
+	}
+	/* Sessions stay on the caller's loop if no worker comes up. */
+	for (i = 0; i < ctrl->config->nworkers; i++) {
+		if (ictrl_worker_start(&ctrl->workers[i]) == -1) {
+			log_warn("%s: worker %d", __func__, i);
+			break;
+		}
+		ctrl->nworkers++;
+	}
+	ictrl_worker_ustart(&ctrl->worker);
+
+	event_set(&ctrl->ev, ctrl->fd, EV_READ | EV_PERSIST,
+	    ictrl_server_accept, ctrl);
 	evtimer_set(&ctrl->evt, ictrl_server_accept, ctrl);
+	if (ctrl->worker.uring != NULL)
+		ictrl_server_uarm(ctrl);
+	else {
+		ctrl->uaccept = -1;
+		event_add(&ctrl->ev, NULL);
+	}
 }
 
 void
@@ -137,238 +377,2733 @@ ictrl_server_stop(struct ictrl_state *ctrl)
 {
 	event_del(&ctrl->ev);
 	event_del(&ctrl->evt);
+	if (ctrl->uaccept == 1)
+		(void)uring_cancel(ctrl->worker.uring, ICTRL_UD_ACCEPT);
+	ctrl->uaccept = -1;
+	ictrl_wheel_stop(&ctrl->worker);
+
+	while (ctrl->nworkers > 0)
+		ictrl_worker_stop(&ctrl->workers[--ctrl->nworkers]);
 }
 
-static void
-ictrl_server_accept(int listenfd, short event, void *v)
+/*
+ * Sum the counters of all workers.  Counters of running workers are
+ * read without synchronization and may be slightly behind.
+ */
+void
+ictrl_server_stats(struct ictrl_state *ctrl, struct ictrl_stats *st)
 {
-	struct ictrl_state	*ctrl = v;
-	int			 connfd;
-	socklen_t		 len;
-	struct sockaddr_un	 sun;
-	struct ictrl_session	*c;
+	struct ictrl_worker *w;
+	int i;
 
-	event_add(&ctrl->ev, NULL);
-	if ((event & EV_TIMEOUT))
-		return;
+	*st = ctrl->worker.stats;
+	st->alloc_fail += ctrl->worker.pool->stats.fail;
+	st->sessions = ctrl->worker.nsessions;
+	for (i = 0; ctrl->workers != NULL && i < ctrl->config->nworkers;
+	    i++) {
+		w = &ctrl->workers[i];
+		st->msgs_in += w->stats.msgs_in;
+		st->msgs_out += w->stats.msgs_out;
+		st->ev_add += w->stats.ev_add;
+		st->ev_del += w->stats.ev_del;
+		st->accepts += w->stats.accepts;
+		st->bcast_drop += w->stats.bcast_drop;
+		st->bytes_in += w->stats.bytes_in;
+		st->bytes_out += w->stats.bytes_out;
+		st->snd_full += w->stats.snd_full;
+		st->closes += w->stats.closes;
+		st->timeouts += w->stats.timeouts;
+		st->alloc_fail += w->stats.alloc_fail + w->pool->stats.fail;
+		st->decode_fail += w->stats.decode_fail;
+		st->queued += w->stats.queued;
+		st->sessions += w->nsessions;
+	}
+}
 
-	len = sizeof(sun);
-	if ((connfd = accept(listenfd,
-	    (struct sockaddr *)&sun, &len)) == -1) {
-		/*
-		 * Pause accept if we are out of file descriptors, or
-		 * libevent will haunt us here too.
-		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
+/*
+ * Register h for messages of type, in place of proc; NULL removes it.
+ * The table is indexed by type, so keep types dense and low.  Handlers
+ * are registered before ictrl_server_start(), as the workers read the
+ * table unlocked.  Types with flag bits or of the library are EINVAL.
+ */
+int
+ictrl_handle(struct ictrl_state *ctrl, u_int16_t type,
+    const struct ictrl_handler *h)
+{
+	struct ictrl_handler *tab;
 
-			event_del(&ctrl->ev);
-			evtimer_add(&ctrl->evt, &evtpause);
-		} else if (errno != EWOULDBLOCK && errno != EINTR &&
-		    errno != ECONNABORTED)
-			log_warn("%s", __func__);
-		return;
+	if ((type & CBUF_MSG_FLAGS) || type >= ICTRL_T_RESERVED ||
+	    (h != NULL && h->fn == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (type >= ctrl->nhandlers) {
+		if (h == NULL)
+			return 0;
+		if ((tab = reallocarray(ctrl->handlers, type + 1,
+		    sizeof(*tab))) == NULL) {
+			log_warn("%s: reallocarray", __func__);
+			return -1;
+		}
+		bzero(tab + ctrl->nhandlers,
+		    (type + 1 - ctrl->nhandlers) * sizeof(*tab));
+		ctrl->handlers = tab;
+		ctrl->nhandlers = type + 1;
 	}
+	if (h == NULL)
+		bzero(&ctrl->handlers[type], sizeof(*h));
+	else
+		ctrl->handlers[type] = *h;
+	return 0;
+}
 
-	if ((c = malloc(sizeof(struct ictrl_session))) == NULL) {
-		log_warn("%s", __func__);
-		close(connfd);
-		return;
+/*
+ * Sum the calls of the handler of type over all workers, read as
+ * ictrl_server_stats() does.
+ */
+void
+ictrl_handler_stats(struct ictrl_state *ctrl, u_int16_t type,
+    struct ictrl_handler_stats *hs)
+{
+	struct ictrl_worker *w;
+	int i;
+
+	bzero(hs, sizeof(*hs));
+	for (i = -1; i < ctrl->config->nworkers; i++) {
+		if (i >= 0 && ctrl->workers == NULL)
+			break;
+		w = (i == -1) ? &ctrl->worker : &ctrl->workers[i];
+		if (type >= w->nhstats)
+			continue;
+		hs->calls += w->hstats[type].calls;
+		hs->errors += w->hstats[type].errors;
+		hs->rejects += w->hstats[type].rejects;
+		hs->ns += w->hstats[type].ns;
 	}
+}
 
-	TAILQ_INIT(&c->channel);
-	c->state = ctrl;
-	c->fd = connfd;
-	ictrl_server_trigger(c);
+/*
+ * Queue a message on every session.  It is built once, and each session
+ * queues a view of it; it is freed when the last one has been sent.
+ * Sessions at hiwat miss it.  Workers are posted the message through
+ * their pipe.  Returns -1 if it could not be built or some worker not
+ * be posted to.
+ */
+int
+ictrl_broadcast(struct ictrl_state *ctrl, u_int16_t type, int argc,
+    struct iovec *argv)
+{
+	return ictrl_server_post(ctrl, 1, 0, type, argc, argv);
+}
+
+/*
+ * Like ictrl_broadcast(), but only to the sessions subscribed to topic.
+ */
+int
+ictrl_publish(struct ictrl_state *ctrl, u_int32_t topic, u_int16_t type,
+    int argc, struct iovec *argv)
+{
+	return ictrl_server_post(ctrl, 0, topic, type, argc, argv);
+}
+
+static int
+ictrl_server_post(struct ictrl_state *ctrl, int all, u_int32_t topic,
+    u_int16_t type, int argc, struct iovec *argv)
+{
+	struct ictrl_worker *self, *w;
+	struct ictrl_handoff h;
+	struct cbuf *cbuf;
+	int i, error = 0;
+
+	/* Not pooled: the last reference may go in any thread. */
+	if ((cbuf = cbuf_compose(NULL, type, 0, argc, argv)) == NULL)
+		return -1;
+	cbuf->flags |= CBUF_F_SHARED;
+
+	h.fd = -1;
+	h.all = all;
+	h.topic = topic;
+	h.cbuf = cbuf;
+	self = ictrl_worker_self(ctrl);
+	ictrl_worker_post(self, &h);
+	for (i = 0; ctrl->workers != NULL && i < ctrl->nworkers; i++) {
+		if ((w = &ctrl->workers[i]) == self)
+			continue;
+		h.cbuf = cbuf_ref(cbuf);
+		if (write(w->pipe[1], &h, sizeof(h)) != sizeof(h)) {
+			cbuf_free(cbuf);
+			error = -1;
+		}
+	}
+	cbuf_free(cbuf);
+	return error;
+}
+
+/*
+ * Sharding policies; return the index of the worker that gets the
+ * next session.  Whatever config->shard returns is taken modulo the
+ * number of workers, as unsigned.
+ */
+int
+ictrl_shard_rr(struct ictrl_state *ctrl)
+{
+	return ctrl->rr++ % ctrl->nworkers;
+}
+
+int
+ictrl_shard_least(struct ictrl_state *ctrl)
+{
+	unsigned int n, min = UINT_MAX;
+	int i, best = 0;
+
+	for (i = 0; i < ctrl->nworkers; i++) {
+		n = __atomic_load_n(&ctrl->workers[i].nsessions,
+		    __ATOMIC_RELAXED);
+		if (n < min) {
+			min = n;
+			best = i;
+		}
+	}
+	return best;
 }
 
+/*
+ * Accept up to acceptmax pending connections per wakeup.
+ */
 static void
-ictrl_server_dispatch(int fd, short event, void *v)
+ictrl_server_accept(int listenfd, short event, void *v)
 {
-	struct ictrl_session *c = v;
+	struct ictrl_state	*ctrl = v;
+	struct ictrl_config	*cf = ctrl->config;
+	int			 connfd, n, max;
 
-	if (event & EV_TIMEOUT) {
-		log_debug("%s: control connection (fd %d) timed out.",
-		    __func__, fd);
-		ictrl_server_close(c);
+	if ((event & EV_TIMEOUT)) {
+		ictrl_server_resume(ctrl);
 		return;
 	}
-	if (event & EV_READ) {
-		struct cbuf *cbuf;
 
-		if ((cbuf = ictrl_recv(c)) == NULL) {
-			ictrl_server_close(c);
+	max = (cf->acceptmax > 0) ? cf->acceptmax : ICTRL_ACCEPTMAX;
+	for (n = 0; n < max; n++) {
+		if ((connfd = accept4(listenfd, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			if (errno == ENFILE || errno == EMFILE) {
+				ictrl_server_shed(ctrl);
+				return;
+			}
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EWOULDBLOCK)
+				log_warn("%s", __func__);
 			return;
 		}
-		(*c->state->config->proc)(c, cbuf);
+		ictrl_server_take(ctrl, connfd);
 	}
-	if (event & EV_WRITE) {
-		switch (ictrl_send(c)) {
-		case -1:
-			ictrl_server_close(c);
+}
+
+/*
+ * Set up a session for an accepted descriptor, here or on a worker.
+ */
+static void
+ictrl_server_take(struct ictrl_state *ctrl, int connfd)
+{
+	if (ctrl->nworkers > 0) {
+		if (ictrl_server_handoff(ctrl, connfd) == -1) {
+			log_warn("%s: handoff", __func__);
+			close(connfd);
+			return;
+		}
+	} else {
+		if (ictrl_session_new(&ctrl->worker, connfd) == NULL) {
+			log_warn("%s", __func__);
+			close(connfd);
 			return;
-		case EAGAIN:
-		default:
-			break;
 		}
+		ctrl->worker.nsessions++;
 	}
-	ictrl_server_trigger(c);
+	ctrl->worker.stats.accepts++;
 }
 
+/*
+ * Have the uring accept on the listener, one request for as many
+ * connections as come.  If it cannot, libevent takes over.
+ */
 static void
-ictrl_server_close(struct ictrl_session *c)
+ictrl_server_uarm(struct ictrl_state *ctrl)
 {
-	struct cbuf *cbuf;
-
-	event_del(&c->ev);
-	close(c->fd);
-
-	/* Some file descriptors are available again. */
-	if (evtimer_pending(&c->state->evt, NULL)) {
-		evtimer_del(&c->state->evt);
-		event_add(&c->state->ev, NULL);
+	if (uring_accept(ctrl->worker.uring, ctrl->fd, ICTRL_UD_ACCEPT) ==
+	    -1) {
+		log_warn("%s", __func__);
+		ctrl->uaccept = -1;
+		event_add(&ctrl->ev, NULL);
+		return;
 	}
+	ctrl->uaccept = 1;
+}
 
-	while ((cbuf = TAILQ_FIRST(&c->channel))) {
-		TAILQ_REMOVE(&c->channel, cbuf, entry);
-		cbuf_free(cbuf);
+/*
+ * A completion of the uring accept: a connection, or a failure.  When
+ * the request ends it is made again, unless accepting is paused or the
+ * failure is one that would only repeat.
+ */
+static void
+ictrl_server_uaccept(struct ictrl_state *ctrl, struct uring_event *ev)
+{
+	if (!ev->more && ctrl->uaccept == 1)
+		ctrl->uaccept = 0;
+	if (ev->res >= 0) {
+		/* Stopped; it was on its way. */
+		if (ctrl->uaccept == -1)
+			close(ev->res);
+		else
+			ictrl_server_take(ctrl, ev->res);
+	} else if (ev->res == -ENFILE || ev->res == -EMFILE)
+		ictrl_server_shed(ctrl);
+	else if (ev->res != -EINTR && ev->res != -ECONNABORTED &&
+	    ev->res != -ECANCELED && ctrl->uaccept == 0) {
+		errno = -ev->res;
+		log_warn("%s", __func__);
+		ctrl->uaccept = -1;
+		event_add(&ctrl->ev, NULL);
 	}
-	free(c);
+	if (ctrl->uaccept == 0 && !evtimer_pending(&ctrl->evt, NULL))
+		ictrl_server_uarm(ctrl);
 }
 
-static void
-ictrl_server_trigger(struct ictrl_session *c)
+/*
+ * Pass an accepted descriptor to the worker picked by the sharding
+ * policy.  The worker sets up the session on its own thread.
+ */
+static int
+ictrl_server_handoff(struct ictrl_state *ctrl, int fd)
 {
-	short flags = EV_READ | (TAILQ_EMPTY(&c->channel) ? 0 : EV_WRITE);
+	struct ictrl_handoff h = { fd, 0, 0, NULL };
+	struct ictrl_worker *w;
+	int i;
 
-	event_del(&c->ev);
-	event_set(&c->ev, c->fd, flags, ictrl_server_dispatch, c);
-	event_add(&c->ev, NULL);
+	i = (ctrl->config->shard != NULL) ?
+	    (*ctrl->config->shard)(ctrl) : ictrl_shard_rr(ctrl);
+	/* As unsigned, so that a negative pick still lands on a worker. */
+	w = &ctrl->workers[(unsigned int)i % ctrl->nworkers];
+
+	__atomic_add_fetch(&w->nsessions, 1, __ATOMIC_RELAXED);
+	if (write(w->pipe[1], &h, sizeof(h)) != sizeof(h)) {
+		__atomic_sub_fetch(&w->nsessions, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
 }
 
 /*
- * API for client
+ * Out of file descriptors.  Give back the reserve descriptor and use
+ * it to accept and close what is pending, so clients see the refusal
+ * at once instead of hanging in the backlog.  Only if the reserve
+ * cannot be taken back do we pause accepting until a session closes.
  */
-
-struct ictrl_session *
-ictrl_client_init(struct ictrl_config *cf)
+static void
+ictrl_server_shed(struct ictrl_state *ctrl)
 {
-	struct ictrl_state	*ctrl;
-	struct sockaddr_un	 sun;
-	int			 fd;
-	struct ictrl_session	*c;
+	struct ictrl_config	*cf = ctrl->config;
+	int			 fd, n, max;
 
-	if ((ctrl = calloc(1, sizeof(*ctrl))) == NULL) {
-		log_warn("%s: calloc", __func__);
-		return NULL;
+	if (ctrl->rfd != -1) {
+		close(ctrl->rfd);
+		ctrl->rfd = -1;
+
+		max = (cf->acceptmax > 0) ? cf->acceptmax : ICTRL_ACCEPTMAX;
+		for (n = 0; n < max; n++) {
+			if ((fd = accept(ctrl->fd, NULL, NULL)) == -1)
+				break;
+			close(fd);
+			ctrl->worker.stats.accept_shed++;
+		}
+		ctrl->rfd = fcntl(ctrl->fd, F_DUPFD_CLOEXEC, 0);
+		if (ctrl->rfd != -1)
+			return;
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
-		err(1, "socket");
+	/*
+	 * Pause accept if we are out of file descriptors, or
+	 * libevent will haunt us here too.
+	 */
+	if (!evtimer_pending(&ctrl->evt, NULL)) {
+		struct timeval evtpause = { 1, 0 };
 
-	bzero(&sun, sizeof(sun));
-	sun.sun_family = AF_UNIX;
-	strlcpy(sun.sun_path, cf->path, sizeof(sun.sun_path));
+		event_del(&ctrl->ev);
+		if (ctrl->uaccept == 1)
+			(void)uring_cancel(ctrl->worker.uring,
+			    ICTRL_UD_ACCEPT);
+		evtimer_add(&ctrl->evt, &evtpause);
+		ctrl->worker.stats.accept_paused++;
+	}
+}
 
-	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
-		err(1, "connect: %s", cf->path);
+/*
+ * Resume accepting after a pause, once descriptors are available.
+ */
+static void
+ictrl_server_resume(struct ictrl_state *ctrl)
+{
+	if (evtimer_pending(&ctrl->evt, NULL))
+		evtimer_del(&ctrl->evt);
+	if (ctrl->rfd == -1)
+		ctrl->rfd = fcntl(ctrl->fd, F_DUPFD_CLOEXEC, 0);
+	/* A uring accept still being cancelled is made again as it ends. */
+	if (ctrl->uaccept == -1)
+		event_add(&ctrl->ev, NULL);
+	else if (ctrl->uaccept == 0)
+		ictrl_server_uarm(ctrl);
+}
 
-	ctrl->config = cf;
-	ctrl->fd = fd;
+static struct ictrl_session *
+ictrl_session_new(struct ictrl_worker *w, int connfd)
+{
+	struct ictrl_session	*c;
+	struct ictrl_slab	*sl;
+	int			 i;
 
-	if ((c = malloc(sizeof(struct ictrl_session))) == NULL) {
-		close(ctrl->fd);
-		free(ctrl);
-		return NULL;
+	if (TAILQ_EMPTY(&w->sfree)) {
+		if ((sl = malloc(sizeof(*sl))) == NULL) {
+			w->stats.alloc_fail++;
+			return NULL;
+		}
+		sl->next = w->slabs;
+		w->slabs = sl;
+		for (i = 0; i < ICTRL_SLAB; i++)
+			TAILQ_INSERT_TAIL(&w->sfree, &sl->s[i], entry);
 	}
+	c = TAILQ_FIRST(&w->sfree);
+	TAILQ_REMOVE(&w->sfree, c, entry);
 
-	c->state = ctrl;
 	TAILQ_INIT(&c->channel);
-	c->fd = -1;
+	c->state = w->state;
+	c->worker = w;
+	c->fd = connfd;
+	c->flags = 0;
+	c->reqid = 0;
+	c->rasm = NULL;
+	c->ring = NULL;
+	c->cold = NULL;
+	c->qbytes = 0;
+	c->qmsgs = 0;
+	bzero(&c->stats, sizeof(c->stats));
+
+	/* Read interest stays registered for the life of the session. */
+	ictrl_event_set(w, &c->evr, connfd, EV_READ | EV_PERSIST,
+	    ictrl_server_dispatch, c);
+	ictrl_event_set(w, &c->evw, connfd, EV_WRITE | EV_PERSIST,
+	    ictrl_server_dispatch, c);
+	if (ictrl_session_read(c, 1) == -1) {
+		TAILQ_INSERT_HEAD(&w->sfree, c, entry);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&w->sessions, c, entry);
+	ictrl_session_touch(c);
 
 	return c;
 }
 
-void
-ictrl_client_fini(struct ictrl_session *c)
+static struct ictrl_session_cold *
+ictrl_session_cold(struct ictrl_session *c)
 {
-	struct ictrl_state	*ctrl = c->state;
+	if (c->cold == NULL &&
+	    (c->cold = calloc(1, sizeof(*c->cold))) != NULL) {
+		TAILQ_INIT(&c->cold->reqs);
+		TAILQ_INIT(&c->cold->subs);
+		TAILQ_INIT(&c->cold->rcvq);
+	}
+	return c->cold;
+}
 
-	free(c);
-	close(ctrl->fd);
-	free(ctrl);
+static void
+ictrl_server_dispatch(int fd, short event, void *v)
+{
+	struct ictrl_session *c = v;
+
+	c->flags |= ICTRL_SF_BUSY;
+	if (c->ring != NULL && fd == c->ring->efd)
+		ring_wake(c->ring);
+	if ((event & EV_READ) && (c->flags & ICTRL_SF_HIWAT) == 0) {
+		struct ictrl_config *cf = c->state->config;
+		struct cbuf *cbufs[ICTRL_BATCH_MAX];
+		int batch, budget, i, n;
+
+		/*
+		 * Dispatch what is queued on the socket, up to rcvbudget
+		 * messages; the rest waits for the next wakeup.
+		 */
+		batch = ictrl_batch(cf->rcvbatch);
+		budget = (cf->rcvbudget > 0) ? cf->rcvbudget : ICTRL_BUDGET;
+		do {
+			if ((n = ictrl_recvv(c, cbufs, MIN(batch, budget))) ==
+			    -1) {
+				ictrl_server_close(c);
+				return;
+			}
+			for (i = 0; i < n; i++)
+				ictrl_server_msg(c, cbufs[i]);
+			budget -= n;
+		} while (n == batch && budget > 0 &&
+		    (c->flags & ICTRL_SF_HIWAT) == 0);
+
+		/* Out of budget; the ring has no level to wake us again. */
+		if (budget <= 0 && c->ring != NULL)
+			ring_kick(c->ring->efd);
+	}
+	ictrl_server_flush(c);
 }
 
 /*
- * API for both server and client
+ * Route a received message to chunk, the library's own types, or the
+ * handler of its type.
  */
+static void
+ictrl_server_msg(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ictrl_config *cf = c->state->config;
+	struct cbuf_msghdr *cmh = cbuf->iov[0].iov_base;
 
-#define CTRLARGV(x...)	((struct iovec []){ x })
+	/* Replies built in proc echo the id. */
+	c->reqid = cbuf->id;
+	if (cbuf->flags & CBUF_F_FRAG)
+		(*cf->chunk)(c, cbuf, cbuf->off, cbuf->frag->total);
+	else if (cmh->type == ICTRL_T_RING)
+		ictrl_server_ring(c, cbuf);
+	else if (cmh->type == ICTRL_T_SUB || cmh->type == ICTRL_T_UNSUB)
+		ictrl_server_sub(c, cbuf);
+	else if (cmh->type == ICTRL_T_STATS)
+		ictrl_server_stat(c, cbuf);
+	else if (cmh->type == ICTRL_T_ERROR)
+		cbuf_free(cbuf);
+	else if (cmh->type >= ICTRL_T_RESERVED)
+		ictrl_server_error(c, cbuf, cmh->type, EOPNOTSUPP);
+	else
+		ictrl_server_proc(c, cbuf, cmh->type);
+	c->reqid = 0;
+}
 
-int
-ictrl_build(struct ictrl_session *c, u_int16_t type, void *buf, size_t len)
+/*
+ * End of a dispatch.  Replies queued by proc are sent right away; write
+ * interest is only registered if the socket cannot take them all.
+ */
+static void
+ictrl_server_flush(struct ictrl_session *c)
 {
-	return ictrl_buildv(c, type, 1, CTRLARGV({ buf, len }));
+	if (!TAILQ_EMPTY(&c->channel)) {
+		switch (ictrl_send(c)) {
+		case -1:
+			ictrl_server_close(c);
+			return;
+		case EAGAIN:
+		default:
+			break;
+		}
+	}
+	if (c->flags & ICTRL_SF_HIWAT)
+		ictrl_server_wat(c);
+	ictrl_session_touch(c);
+	c->flags &= ~ICTRL_SF_BUSY;
+	ictrl_server_trigger(c);
 }
 
-int
-ictrl_buildv(struct ictrl_session *c, u_int16_t type, int argc,
-    struct iovec *argv)
+/*
+ * Take a datagram received with io_uring as ictrl_recvv() would, and
+ * dispatch the message if it is complete.  It is always copied, as the
+ * buffer goes back to the ring.  Returns -1 to close the session.
+ */
+static int
+ictrl_server_input(struct ictrl_session *c, struct msghdr *msg, void *buf,
+    size_t len)
 {
 	struct cbuf *cbuf;
-	struct cbuf_msghdr *cmh;
 
-	cbuf = cbuf_compose(argc, argv);
+	/* A zero-length datagram is EOF, as with recvmmsg(2). */
+	if (len == 0) {
+		ictrl_fds(msg, NULL);
+		return -1;
+	}
+	if ((cbuf = cbuf_decompose(c->worker->pool, buf, len)) == NULL) {
+		ictrl_fds(msg, NULL);
+		c->worker->stats.decode_fail++;
+		return -1;
+	}
+	if (ictrl_fds(msg, cbuf) == -1) {
+		cbuf_free(cbuf);
+		return -1;
+	}
+	if (cbuf->flags & CBUF_F_FRAG) {
+		switch (ictrl_reasm(c, &cbuf)) {
+		case -1:
+			return -1;
+		case 0:
+			ictrl_count_in(c, 0, len);
+			return 0;
+		}
+	}
+	ictrl_count_in(c, 1, len);
+	c->flags |= ICTRL_SF_BUSY;
+	ictrl_server_msg(c, cbuf);
+	return 0;
+}
+
+/*
+ * Start or stop reading a server session: read interest with libevent,
+ * a multishot receive with io_uring.  A receive being cancelled is made
+ * again as it ends if reading is on by then.  Returns -1 if reading
+ * cannot start.
+ */
+static int
+ictrl_session_read(struct ictrl_session *c, int on)
+{
+	struct ictrl_worker *w = c->worker;
+
+	if (w->uring == NULL) {
+		if (on) {
+			event_add(&c->evr, NULL);
+			w->stats.ev_add++;
+		} else {
+			event_del(&c->evr);
+			w->stats.ev_del++;
+		}
+		return 0;
+	}
+	if (on) {
+		if (c->flags & ICTRL_SF_URECV)
+			return 0;
+		if (uring_recvmsg(w->uring, c->fd, (uintptr_t)c) == -1)
+			return -1;
+		c->flags |= ICTRL_SF_URECV;
+	} else if ((c->flags & (ICTRL_SF_URECV | ICTRL_SF_UCANCEL)) ==
+	    ICTRL_SF_URECV) {
+		if (uring_cancel(w->uring, (uintptr_t)c) == -1)
+			return -1;
+		c->flags |= ICTRL_SF_UCANCEL;
+	}
+	return 0;
+}
+
+/*
+ * A completion of the uring receive of c: a datagram in a buffer of the
+ * ring, or the end of the receive.  What was on its way when c closed is
+ * dropped.  Datagrams still come in for a while after reading stops for
+ * hiwat, and are dispatched all the same.
+ */
+static void
+ictrl_session_urecv(struct ictrl_session *c, struct uring_event *ev)
+{
+	struct ictrl_worker *w = c->worker;
+	struct msghdr msg;
+	size_t len;
+	void *buf;
+	int closed = (c->flags & ICTRL_SF_CLOSED) != 0, fail = 0;
+
+	if (!ev->more)
+		c->flags &= ~(ICTRL_SF_URECV | ICTRL_SF_UCANCEL);
+	if (ev->bid != -1) {
+		if (uring_msg(w->uring, ev, &msg, &buf, &len) == -1 ||
+		    closed) {
+			ictrl_fds(&msg, NULL);
+			if (!closed) {
+				w->stats.decode_fail++;
+				fail = 1;
+			}
+		} else if (ictrl_server_input(c, &msg, buf, len) == -1)
+			fail = 1;
+		uring_put(w->uring, ev->bid);
+	} else if (ev->res != -ENOBUFS && ev->res != -ECANCELED)
+		fail = 1;	/* EOF or error */
+
+	if (closed) {
+		/* Its slot was kept for this. */
+		if (!ev->more)
+			TAILQ_INSERT_HEAD(&w->sfree, c, entry);
+		return;
+	}
+	if (fail) {
+		ictrl_server_close(c);
+		return;
+	}
+	/* Out of buffers, or cancelled for hiwat and since drained. */
+	if (!ev->more && (c->flags & ICTRL_SF_HIWAT) == 0 &&
+	    ictrl_session_read(c, 1) == -1) {
+		log_warn("%s", __func__);
+		ictrl_server_close(c);
+	}
+}
+
+static void
+ictrl_server_close(struct ictrl_session *c)
+{
+	struct ictrl_sub *s;
+	struct cbuf *cbuf;
+
+	struct ictrl_worker *w = c->worker;
+
+	(void)ictrl_session_read(c, 0);
+	if (c->flags & ICTRL_SF_WRITE) {
+		event_del(&c->evw);
+		w->stats.ev_del++;
+	}
+	if (c->ring != NULL) {
+		event_del(&c->cold->evd);
+		w->stats.ev_del++;
+		ring_destroy(c->ring);
+		free(c->ring);
+	}
+	close(c->fd);
+	w->stats.closes++;
+	TAILQ_REMOVE(&w->sessions, c, entry);
+	if (c->flags & ICTRL_SF_TIMER)
+		TAILQ_REMOVE(&w->wheel[c->slot], c, tentry);
+	__atomic_sub_fetch(&w->nsessions, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * Some file descriptors are available again.  Workers leave it
+	 * to the pause timer; the listener is not theirs to touch.
+	 */
+	if (w == &c->state->worker && evtimer_pending(&c->state->evt, NULL))
+		ictrl_server_resume(c->state);
+
+	while ((cbuf = TAILQ_FIRST(&c->channel)))
+		ictrl_dequeue(c, cbuf);
+	if (c->rasm != NULL)
+		cbuf_free(c->rasm);
+	if (c->cold != NULL) {
+		while ((s = TAILQ_FIRST(&c->cold->subs)) != NULL)
+			ictrl_topic_del(c, s);
+		free(c->cold);
+	}
+	/* A uring receive still refers to c; its end frees it. */
+	c->flags |= ICTRL_SF_CLOSED;
+	if (c->flags & ICTRL_SF_URECV)
+		return;
+	TAILQ_INSERT_HEAD(&w->sfree, c, entry);
+}
+
+/*
+ * Register write interest when the channel becomes non-empty and drop
+ * it when the channel drains.  Nothing to do in steady state.
+ */
+static void
+ictrl_server_trigger(struct ictrl_session *c)
+{
+	int want = !TAILQ_EMPTY(&c->channel);
+
+	/*
+	 * Rings are always writable; a full one is waited for with the
+	 * doorbell, which stays registered.
+	 */
+	if (c->ring != NULL) {
+		if (want && (c->flags & ICTRL_SF_BUSY) == 0) {
+			(void)ictrl_ring_send(c);
+			/* Drained; let dispatch resume reading. */
+			if ((c->flags & ICTRL_SF_HIWAT) &&
+			    c->qbytes <= c->state->config->lowat)
+				ring_kick(c->ring->efd);
+		}
+		return;
+	}
+
+	if (want == ((c->flags & ICTRL_SF_WRITE) != 0))
+		return;
+	if (want) {
+		event_add(&c->evw, NULL);
+		c->flags |= ICTRL_SF_WRITE;
+		c->worker->stats.ev_add++;
+	} else {
+		event_del(&c->evw);
+		c->flags &= ~ICTRL_SF_WRITE;
+		c->worker->stats.ev_del++;
+	}
+}
+
+/*
+ * Output flow control.  Once the channel holds hiwat bytes the session
+ * is not read from, so that a peer not reading its replies cannot make
+ * us queue without bound, and builds fail with errno EAGAIN.  When
+ * sending brings it down to lowat, reading resumes and config->drain
+ * is called.
+ */
+static void
+ictrl_server_wat(struct ictrl_session *c)
+{
+	struct ictrl_config *cf = c->state->config;
+	int server = (c->flags & ICTRL_SF_CLIENT) == 0 && c->fd != -1;
+
+	if ((c->flags & ICTRL_SF_HIWAT) == 0) {
+		if (cf->hiwat == 0 || c->qbytes < cf->hiwat)
+			return;
+		c->flags |= ICTRL_SF_HIWAT;
+		if (server)
+			(void)ictrl_session_read(c, 0);
+		return;
+	}
+	if (c->qbytes > cf->lowat)
+		return;
+	c->flags &= ~ICTRL_SF_HIWAT;
+	if (server) {
+		if (ictrl_session_read(c, 1) == -1)
+			log_warn("%s", __func__);
+		/* What is left in the ring rang no bell. */
+		if (c->ring != NULL)
+			ring_kick(c->ring->efd);
+	}
+	if (cf->drain != NULL)
+		(*cf->drain)(c);
+}
+
+/*
+ * Workers
+ */
+
+static int
+ictrl_worker_init(struct ictrl_worker *w, struct ictrl_state *ctrl)
+{
+	bzero(w, sizeof(*w));
+	w->state = ctrl;
+	w->pipe[0] = w->pipe[1] = -1;
+	TAILQ_INIT(&w->sessions);
+	TAILQ_INIT(&w->sfree);
+	if ((w->pool = cbuf_pool_new(CBUF_POOL_MAXFREE)) == NULL)
+		return -1;
+	return 0;
+}
+
+static void
+ictrl_worker_fini(struct ictrl_worker *w)
+{
+	struct ictrl_slab *sl;
+
+	while (!TAILQ_EMPTY(&w->sessions))
+		ictrl_server_close(TAILQ_FIRST(&w->sessions));
+	ictrl_worker_ustop(w);
+	while ((sl = w->slabs) != NULL) {
+		w->slabs = sl->next;
+		free(sl);
+	}
+	TAILQ_INIT(&w->sfree);
+	free(w->topics);
+	w->topics = NULL;
+	free(w->wheel);
+	w->wheel = NULL;
+	free(w->hstats);
+	w->hstats = NULL;
+	w->nhstats = 0;
+	/* Messages still held elsewhere keep the pool until freed. */
+	cbuf_pool_free(w->pool);
+	w->pool = NULL;
+}
+
+static int
+ictrl_worker_start(struct ictrl_worker *w)
+{
+	sigset_t set, oset;
+	int error;
+
+	if ((w->base = event_base_new()) == NULL)
+		return -1;
+	if (pipe2(w->pipe, O_CLOEXEC) == -1)
+		goto fail;
+	if (fcntl(w->pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(w->pipe[1], F_SETFL, O_NONBLOCK) == -1)
+		goto fail;
+	ictrl_event_set(w, &w->ev, w->pipe[0], EV_READ | EV_PERSIST,
+	    ictrl_worker_handoff, w);
+	event_add(&w->ev, NULL);
+	if (ictrl_wheel_start(w) == -1)
+		log_warn("%s: timer wheel", __func__);
+	ictrl_worker_ustart(w);
+
+	/* Signals are for the caller's loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	error = pthread_create(&w->thread, NULL, ictrl_worker_main, w);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error == 0)
+		return 0;
+
+	ictrl_worker_ustop(w);
+	ictrl_wheel_stop(w);
+	event_del(&w->ev);
+fail:
+	if (w->pipe[0] != -1) {
+		close(w->pipe[0]);
+		close(w->pipe[1]);
+		w->pipe[0] = w->pipe[1] = -1;
+	}
+	event_base_free(w->base);
+	w->base = NULL;
+	return -1;
+}
+
+/*
+ * Stop the thread, then tear down what it owned from here.
+ */
+static void
+ictrl_worker_stop(struct ictrl_worker *w)
+{
+	struct ictrl_handoff h = { -1, 0, 0, NULL };
+
+	/* Make sure the wakeup is not lost to a full pipe. */
+	(void)fcntl(w->pipe[1], F_SETFL, 0);
+	(void)write(w->pipe[1], &h, sizeof(h));
+	pthread_join(w->thread, NULL);
+
+	/* Drop what was posted too late. */
+	while (read(w->pipe[0], &h, sizeof(h)) == sizeof(h)) {
+		if (h.cbuf != NULL)
+			cbuf_free(h.cbuf);
+		else if (h.fd != -1) {
+			close(h.fd);
+			__atomic_sub_fetch(&w->nsessions, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	while (!TAILQ_EMPTY(&w->sessions))
+		ictrl_server_close(TAILQ_FIRST(&w->sessions));
+	ictrl_worker_ustop(w);
+	ictrl_wheel_stop(w);
+	event_del(&w->ev);
+	close(w->pipe[0]);
+	close(w->pipe[1]);
+	w->pipe[0] = w->pipe[1] = -1;
+	event_base_free(w->base);
+	w->base = NULL;
+}
+
+static void *
+ictrl_worker_main(void *v)
+{
+	struct ictrl_worker *w = v;
+
+	event_base_dispatch(w->base);
+	return NULL;
+}
+
+/*
+ * Set up sessions for descriptors passed by the listener.  -1 tells the
+ * worker to exit.
+ */
+static void
+ictrl_worker_handoff(int fd, short event, void *v)
+{
+	struct ictrl_worker *w = v;
+	struct ictrl_handoff h[ICTRL_ACCEPTMAX];
+	ssize_t n;
+	int i;
+
+	if ((n = read(fd, h, sizeof(h))) <= 0)
+		return;
+	for (i = 0; i < n / (ssize_t)sizeof(h[0]); i++) {
+		if (h[i].cbuf != NULL) {
+			ictrl_worker_post(w, &h[i]);
+			cbuf_free(h[i].cbuf);
+			continue;
+		}
+		if (h[i].fd == -1) {
+			event_base_loopbreak(w->base);
+			continue;
+		}
+		if (ictrl_session_new(w, h[i].fd) == NULL) {
+			log_warn("%s", __func__);
+			close(h[i].fd);
+			__atomic_sub_fetch(&w->nsessions, 1,
+			    __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Receive with io_uring if the config asks for it and the kernel has
+ * it; else the worker stays with libevent alone.
+ */
+static void
+ictrl_worker_ustart(struct ictrl_worker *w)
+{
+	if ((w->state->config->flags & ICTRL_F_URING) == 0)
+		return;
+	if ((w->uring = uring_new(ICTRL_URINGBUFS, CBUF_BUF_SIZE,
+	    sizeof(union ictrl_cmsgbuf))) == NULL) {
+		log_debug("%s: io_uring: %s; using libevent", __func__,
+		    strerror(errno));
+		return;
+	}
+	ictrl_event_set(w, &w->evu, uring_fd(w->uring), EV_READ | EV_PERSIST,
+	    ictrl_worker_reap, w);
+	event_add(&w->evu, NULL);
+}
+
+static void
+ictrl_worker_ustop(struct ictrl_worker *w)
+{
+	if (w->uring == NULL)
+		return;
+	event_del(&w->evu);
+	uring_free(w->uring);
+	w->uring = NULL;
+}
+
+/*
+ * Take the completions of the worker's uring, as many per wakeup as
+ * there are buffers.  Datagrams of a session tend to come in runs; the
+ * replies to a run are sent as one, at its end.
+ */
+static void
+ictrl_worker_reap(int fd, short event, void *v)
+{
+	struct ictrl_worker *w = v;
+	struct ictrl_session *c, *run = NULL;
+	struct uring_event ev;
+	u_int64_t n;
+	int i;
+
+	(void)read(fd, &n, sizeof(n));
+	for (i = 0; i < ICTRL_URINGBUFS && uring_get(w->uring, &ev); i++) {
+		if (ev.ud == URING_UD_NONE)
+			continue;
+		if (ev.ud == ICTRL_UD_ACCEPT) {
+			ictrl_server_uaccept(w->state, &ev);
+			continue;
+		}
+		c = (struct ictrl_session *)(uintptr_t)ev.ud;
+		if (run != NULL && run != c &&
+		    (run->flags & ICTRL_SF_CLOSED) == 0)
+			ictrl_server_flush(run);
+		ictrl_session_urecv(c, &ev);
+		run = c;
+	}
+	if (run != NULL && (run->flags & ICTRL_SF_CLOSED) == 0)
+		ictrl_server_flush(run);
+	/* Out of budget; the eventfd has no level to wake us again. */
+	if (i == ICTRL_URINGBUFS)
+		ring_kick(fd);
+}
+
+/*
+ * The worker of the calling thread: a worker thread's own, else the
+ * caller's loop.
+ */
+static struct ictrl_worker *
+ictrl_worker_self(struct ictrl_state *ctrl)
+{
+	pthread_t self = pthread_self();
+	int i;
+
+	for (i = 0; ctrl->workers != NULL && i < ctrl->nworkers; i++)
+		if (ctrl->workers[i].base != NULL &&
+		    pthread_equal(ctrl->workers[i].thread, self))
+			return &ctrl->workers[i];
+	return &ctrl->worker;
+}
+
+/*
+ * Queue views of posted message h->cbuf on the sessions of w it is for.
+ */
+static void
+ictrl_worker_post(struct ictrl_worker *w, struct ictrl_handoff *h)
+{
+	struct ictrl_session *c;
+	struct ictrl_topic *t;
+	struct ictrl_sub *s;
+
+	if (h->all) {
+		TAILQ_FOREACH(c, &w->sessions, entry)
+			ictrl_worker_view(w, c, h->cbuf);
+	} else if ((t = ictrl_topic_find(w, h->topic)) != NULL) {
+		TAILQ_FOREACH(s, &t->subs, entry)
+			ictrl_worker_view(w, s->session, h->cbuf);
+	}
+}
+
+static void
+ictrl_worker_view(struct ictrl_worker *w, struct ictrl_session *c,
+    struct cbuf *cbuf)
+{
+	struct ictrl_config *cf = w->state->config;
+	struct cbuf *view;
+
+	if ((cf->hiwat > 0 && c->qbytes >= cf->hiwat) ||
+	    (view = cbuf_view(w->pool, cbuf)) == NULL) {
+		w->stats.bcast_drop++;
+		return;
+	}
+	ictrl_push(c, view);
+}
+
+/*
+ * Session timeouts.  Each worker keeps its sessions on a wheel of
+ * ICTRL_WHEEL slots, one per tick, by deadline.  Activity only moves
+ * the deadline on; a session is put in its new slot when the old one
+ * comes round, so refreshing it costs no timer operation.
+ */
+static int
+ictrl_wheel_start(struct ictrl_worker *w)
+{
+	struct ictrl_config *cf = w->state->config;
+	struct timeval tv = { 0, ICTRL_TICK * 1000 };
+	int i;
+
+	if (cf->idletimo <= 0 && cf->reqtimo <= 0)
+		return 0;
+	if ((w->wheel = calloc(ICTRL_WHEEL, sizeof(*w->wheel))) == NULL)
+		return -1;
+	for (i = 0; i < ICTRL_WHEEL; i++)
+		TAILQ_INIT(&w->wheel[i]);
+	ictrl_event_set(w, &w->evtick, -1, 0, ictrl_wheel_tick, w);
+	evtimer_add(&w->evtick, &tv);
+	return 0;
+}
+
+static void
+ictrl_wheel_stop(struct ictrl_worker *w)
+{
+	if (w->wheel != NULL)
+		evtimer_del(&w->evtick);
+}
+
+static void
+ictrl_wheel_tick(int fd, short event, void *v)
+{
+	struct ictrl_worker *w = v;
+	struct ictrl_wheel q;
+	struct ictrl_session *c;
+	struct timeval tv = { 0, ICTRL_TICK * 1000 };
+	u_int32_t now = ++w->ticks;
+
+	TAILQ_INIT(&q);
+	TAILQ_CONCAT(&q, &w->wheel[now & (ICTRL_WHEEL - 1)], tentry);
+	while ((c = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, c, tentry);
+		c->flags &= ~ICTRL_SF_TIMER;
+		if ((int32_t)(c->deadline - now) <= 0) {
+			if (ictrl_session_timo(c) > 0) {
+				log_debug("%s: control connection (fd %d) "
+				    "timed out.", __func__, c->fd);
+				w->stats.timeouts++;
+				ictrl_server_close(c);
+				continue;
+			}
+			/* No timeout in this state; look again later. */
+			c->deadline = now + ICTRL_WHEEL;
+		}
+		c->slot = c->deadline & (ICTRL_WHEEL - 1);
+		TAILQ_INSERT_TAIL(&w->wheel[c->slot], c, tentry);
+		c->flags |= ICTRL_SF_TIMER;
+	}
+	evtimer_add(&w->evtick, &tv);
+}
+
+/*
+ * A session in the middle of a request, with a message partly received
+ * or replies the peer has yet to take, gets reqtimo; otherwise idletimo.
+ */
+static int
+ictrl_session_timo(struct ictrl_session *c)
+{
+	struct ictrl_config *cf = c->state->config;
+
+	if (cf->reqtimo > 0 &&
+	    (c->rasm != NULL || !TAILQ_EMPTY(&c->channel)))
+		return cf->reqtimo;
+	return cf->idletimo;
+}
+
+static void
+ictrl_session_touch(struct ictrl_session *c)
+{
+	struct ictrl_worker *w = c->worker;
+	u_int32_t turn;
+	int ms;
+
+	if (w->wheel == NULL)
+		return;
+	if ((ms = ictrl_session_timo(c)) > 0)
+		c->deadline = w->ticks + (ms + ICTRL_TICK - 1) / ICTRL_TICK +
+		    1;
+	else
+		c->deadline = w->ticks + ICTRL_WHEEL;
+	if (c->flags & ICTRL_SF_TIMER) {
+		/* Moves only if its slot would come round too late. */
+		turn = w->ticks + 1 +
+		    ((c->slot - w->ticks - 1) & (ICTRL_WHEEL - 1));
+		if ((int32_t)(c->deadline - turn) >= 0)
+			return;
+		TAILQ_REMOVE(&w->wheel[c->slot], c, tentry);
+		c->flags &= ~ICTRL_SF_TIMER;
+	}
+	c->slot = c->deadline & (ICTRL_WHEEL - 1);
+	TAILQ_INSERT_TAIL(&w->wheel[c->slot], c, tentry);
+	c->flags |= ICTRL_SF_TIMER;
+}
+
+static void
+ictrl_event_set(struct ictrl_worker *w, struct event *ev, int fd,
+    short flags, void (*cb)(int, short, void *), void *arg)
+{
+	event_set(ev, fd, flags, cb, arg);
+	if (w->base != NULL)
+		event_base_set(w->base, ev);
+}
+
+/*
+ * API for client
+ */
+
+struct ictrl_session *
+ictrl_client_init(struct ictrl_config *cf)
+{
+	struct ictrl_state	*ctrl;
+	struct sockaddr_un	 sun;
+	int			 fd;
+	struct ictrl_session	*c;
+
+	if ((ctrl = calloc(1, sizeof(*ctrl))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return NULL;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		log_warn("%s: socket", __func__);
+		free(ctrl);
+		return NULL;
+	}
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, cf->path, sizeof(sun.sun_path));
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		log_warn("%s: connect: %s", __func__, cf->path);
+		close(fd);
+		free(ctrl);
+		return NULL;
+	}
+
+	ctrl->config = cf;
+	ctrl->fd = fd;
+	ctrl->rfd = -1;
+	if (ictrl_worker_init(&ctrl->worker, ctrl) == -1) {
+		close(ctrl->fd);
+		free(ctrl);
+		return NULL;
+	}
+
+	if ((c = malloc(sizeof(struct ictrl_session))) == NULL) {
+		close(ctrl->fd);
+		cbuf_pool_free(ctrl->worker.pool);
+		free(ctrl);
+		return NULL;
+	}
+
+	c->state = ctrl;
+	c->worker = &ctrl->worker;
+	TAILQ_INIT(&c->channel);
+	c->fd = -1;
+	c->flags = 0;
+	c->reqid = 0;
+	c->rasm = NULL;
+	c->ring = NULL;
+	c->cold = NULL;
+	c->qbytes = 0;
+	c->qmsgs = 0;
+	bzero(&c->stats, sizeof(c->stats));
+
+	/* Failing that, the session stays on the socket. */
+	if (cf->flags & ICTRL_F_RING)
+		(void)ictrl_client_ring(c);
+
+	return c;
+}
+
+void
+ictrl_client_fini(struct ictrl_session *c)
+{
+	struct ictrl_state	*ctrl = c->state;
+	struct cbuf		*cbuf;
+
+	if (c->rasm != NULL)
+		cbuf_free(c->rasm);
+	if (c->ring != NULL) {
+		ring_destroy(c->ring);
+		free(c->ring);
+	}
+	if (c->cold != NULL) {
+		if (c->cold->ring != NULL) {
+			ring_destroy(c->cold->ring);
+			free(c->cold->ring);
+		}
+		while ((cbuf = TAILQ_FIRST(&c->cold->rcvq)) != NULL) {
+			TAILQ_REMOVE(&c->cold->rcvq, cbuf, entry);
+			cbuf_free(cbuf);
+		}
+		free(c->cold);
+	}
+	free(c);
+	close(ctrl->fd);
+	ictrl_worker_fini(&ctrl->worker);
+	free(ctrl);
+}
+
+/*
+ * Event-driven client.  The session runs on base (the global loop if
+ * NULL); connect does not block.  config->status is called with 0 once
+ * connected, or with an errno when the connection fails or drops.
+ * Replies are passed to the callback given to ictrl_request(), in
+ * request order; other messages go to config->proc.  With
+ * ICTRL_F_REQID, requests carry an id and replies are matched by it,
+ * in any order.
+ */
+struct ictrl_session *
+ictrl_client_open(struct ictrl_config *cf, struct event_base *base)
+{
+	struct ictrl_state	*ctrl;
+	struct ictrl_session	*c;
+	struct ictrl_worker	*w;
+	int			 fd;
+
+	if ((ctrl = calloc(1, sizeof(*ctrl))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return NULL;
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL ||
+	    ictrl_session_cold(c) == NULL) {
+		log_warn("%s: calloc", __func__);
+		free(c);
+		free(ctrl);
+		return NULL;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+	    SOCK_CLOEXEC, 0)) == -1) {
+		log_warn("%s: socket", __func__);
+		free(c->cold);
+		free(c);
+		free(ctrl);
+		return NULL;
+	}
+
+	ctrl->config = cf;
+	ctrl->fd = fd;
+	ctrl->rfd = -1;
+	w = &ctrl->worker;
+	if (ictrl_worker_init(w, ctrl) == -1) {
+		log_warn("%s: pool", __func__);
+		close(fd);
+		free(c->cold);
+		free(c);
+		free(ctrl);
+		return NULL;
+	}
+	w->base = base;
+
+	c->state = ctrl;
+	c->worker = w;
+	c->fd = fd;
+	c->flags = ICTRL_SF_CLIENT | ICTRL_SF_CONNECTING;
+	TAILQ_INIT(&c->channel);
+	if (cf->flags & ICTRL_F_REQID) {
+		int i;
+
+		if ((c->cold->reqtab = calloc(ICTRL_REQHASH,
+		    sizeof(*c->cold->reqtab))) == NULL) {
+			log_warn("%s: calloc", __func__);
+			close(fd);
+			cbuf_pool_free(w->pool);
+			free(c->cold);
+			free(c);
+			free(ctrl);
+			return NULL;
+		}
+		for (i = 0; i < ICTRL_REQHASH; i++)
+			TAILQ_INIT(&c->cold->reqtab[i]);
+	}
+	ictrl_event_set(w, &c->evr, fd, EV_READ | EV_PERSIST,
+	    ictrl_client_dispatch, c);
+	ictrl_event_set(w, &c->evw, fd, EV_WRITE | EV_PERSIST,
+	    ictrl_client_dispatch, c);
+	ictrl_event_set(w, &c->cold->evt, -1, 0, ictrl_client_retry, c);
+
+	if (ictrl_client_connect(c) == -1) {
+		log_warn("%s: connect: %s", __func__, cf->path);
+		close(fd);
+		cbuf_pool_free(w->pool);
+		free(c->cold->reqtab);
+		free(c->cold);
+		free(c);
+		free(ctrl);
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * Close the session; requests still waiting get a NULL reply.  Safe to
+ * call from the session's own callbacks.
+ */
+void
+ictrl_client_close(struct ictrl_session *c)
+{
+	ictrl_client_fail(c, 0);
+	if (c->flags & ICTRL_SF_BUSY)
+		c->flags |= ICTRL_SF_FREE;
+	else
+		ictrl_client_free(c);
+}
+
+/*
+ * Queue a request; done is called with the reply, which it must free,
+ * or with NULL if the session closes first.  Only event-driven clients
+ * have replies dispatched; others get EINVAL.
+ */
+int
+ictrl_request(struct ictrl_session *c, u_int16_t type, int argc,
+    struct iovec *argv, void (*done)(struct ictrl_session *, struct cbuf *,
+    void *), void *arg)
+{
+	struct ictrl_session_cold *cc = c->cold;
+	struct ictrl_req *req;
+	u_int32_t id = 0;
+
+	if ((c->flags & ICTRL_SF_CLIENT) == 0 || cc == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((req = malloc(sizeof(*req))) == NULL)
+		return -1;
+	if (cc->reqtab != NULL) {
+		/* Never 0, which means no id. */
+		if ((id = ++c->reqid) == 0)
+			id = ++c->reqid;
+	}
+	if (ictrl_enqueue(c, type, id, -1, argc, argv) == -1) {
+		free(req);
+		return -1;
+	}
+	req->id = id;
+	req->done = done;
+	req->arg = arg;
+	TAILQ_INSERT_TAIL(&cc->reqs, req, entry);
+	if (cc->reqtab != NULL)
+		TAILQ_INSERT_TAIL(&cc->reqtab[id & (ICTRL_REQHASH - 1)], req,
+		    hentry);
+	return 0;
+}
+
+/*
+ * Start connecting.  Completion is seen as writability; a full listen
+ * queue is retried shortly.
+ */
+static int
+ictrl_client_connect(struct ictrl_session *c)
+{
+	struct sockaddr_un	 sun;
+	struct timeval		 tv = { 0, 10000 };
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, c->state->config->path,
+	    sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (connect(c->fd, (struct sockaddr *)&sun, sizeof(sun)) == 0 ||
+	    errno == EINPROGRESS) {
+		if ((c->flags & ICTRL_SF_WRITE) == 0) {
+			event_add(&c->evw, NULL);
+			c->flags |= ICTRL_SF_WRITE;
+			c->worker->stats.ev_add++;
+		}
+		return 0;
+	}
+	if (errno == EAGAIN) {
+		evtimer_add(&c->cold->evt, &tv);
+		return 0;
+	}
+	return -1;
+}
+
+static void
+ictrl_client_retry(int fd, short event, void *v)
+{
+	struct ictrl_session *c = v;
+
+	if (ictrl_client_connect(c) == -1) {
+		ictrl_client_fail(c, errno);
+		if (c->flags & ICTRL_SF_FREE)
+			ictrl_client_free(c);
+	}
+}
+
+static void
+ictrl_client_dispatch(int fd, short event, void *v)
+{
+	struct ictrl_session *c = v;
+	struct ictrl_config *cf = c->state->config;
+	socklen_t len;
+	int error;
+
+	c->flags |= ICTRL_SF_BUSY;
+	if (c->flags & ICTRL_SF_CONNECTING) {
+		if ((event & EV_WRITE) == 0)
+			goto done;
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+		if (error != 0) {
+			ictrl_client_fail(c, error);
+			goto done;
+		}
+		c->flags &= ~ICTRL_SF_CONNECTING;
+		event_add(&c->evr, NULL);
+		c->worker->stats.ev_add++;
+		if (cf->status != NULL)
+			(*cf->status)(c, 0);
+	}
+	if ((event & EV_READ) && !(c->flags & ICTRL_SF_CLOSED)) {
+		struct cbuf *cbufs[ICTRL_BATCH_MAX];
+		int batch, budget, i, n;
+
+		batch = ictrl_batch(cf->rcvbatch);
+		budget = (cf->rcvbudget > 0) ? cf->rcvbudget : ICTRL_BUDGET;
+		do {
+			if ((n = ictrl_recvv(c, cbufs, MIN(batch, budget))) ==
+			    -1) {
+				ictrl_client_fail(c, ECONNRESET);
+				goto done;
+			}
+			for (i = 0; i < n; i++)
+				ictrl_client_reply(c, cbufs[i]);
+			budget -= n;
+		} while (n == batch && budget > 0 &&
+		    !(c->flags & ICTRL_SF_CLOSED));
+	}
+	if (!TAILQ_EMPTY(&c->channel) && !(c->flags & ICTRL_SF_CLOSED)) {
+		if (ictrl_send(c) == -1) {
+			ictrl_client_fail(c, errno);
+			goto done;
+		}
+	}
+	if (c->flags & ICTRL_SF_HIWAT)
+		ictrl_server_wat(c);
+
+done:
+	c->flags &= ~ICTRL_SF_BUSY;
+	if (c->flags & ICTRL_SF_FREE)
+		ictrl_client_free(c);
+	else if (!(c->flags & (ICTRL_SF_CLOSED | ICTRL_SF_CONNECTING)))
+		ictrl_server_trigger(c);
+}
+
+static void
+ictrl_client_reply(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ictrl_session_cold *cc = c->cold;
+	struct ictrl_req *req;
+
+	if (c->flags & ICTRL_SF_CLOSED) {
+		cbuf_free(cbuf);
+		return;
+	}
+	if (cc->reqtab != NULL) {
+		struct ictrl_reqq *q = &cc->reqtab[cbuf->id &
+		    (ICTRL_REQHASH - 1)];
+
+		TAILQ_FOREACH(req, q, hentry)
+			if (cbuf->id != 0 && req->id == cbuf->id)
+				break;
+		if (req != NULL)
+			TAILQ_REMOVE(q, req, hentry);
+	} else
+		req = TAILQ_FIRST(&cc->reqs);
+
+	if (req == NULL) {
+		if (c->state->config->proc != NULL)
+			(*c->state->config->proc)(c, cbuf);
+		else
+			cbuf_free(cbuf);
+		return;
+	}
+	TAILQ_REMOVE(&cc->reqs, req, entry);
+	(*req->done)(c, cbuf, req->arg);
+	free(req);
+}
+
+/*
+ * Tear the connection down and fail what is outstanding.  The session
+ * stays allocated until ictrl_client_close().
+ */
+static void
+ictrl_client_fail(struct ictrl_session *c, int error)
+{
+	struct ictrl_config *cf = c->state->config;
+	struct ictrl_session_cold *cc = c->cold;
+	struct ictrl_req *req;
+	struct cbuf *cbuf;
+	int busy;
+
+	if (c->flags & ICTRL_SF_CLOSED)
+		return;
+	c->flags |= ICTRL_SF_CLOSED;
+
+	/* The callbacks below may close the session. */
+	busy = c->flags & ICTRL_SF_BUSY;
+	c->flags |= ICTRL_SF_BUSY;
+
+	event_del(&c->evr);
+	event_del(&c->evw);
+	evtimer_del(&cc->evt);
+	c->flags &= ~(ICTRL_SF_WRITE | ICTRL_SF_HIWAT);
+	close(c->fd);
+
+	while ((cbuf = TAILQ_FIRST(&c->channel)))
+		ictrl_dequeue(c, cbuf);
+	if (c->rasm != NULL) {
+		cbuf_free(c->rasm);
+		c->rasm = NULL;
+	}
+	while ((req = TAILQ_FIRST(&cc->reqs))) {
+		TAILQ_REMOVE(&cc->reqs, req, entry);
+		if (cc->reqtab != NULL)
+			TAILQ_REMOVE(&cc->reqtab[req->id & (ICTRL_REQHASH - 1)],
+			    req, hentry);
+		(*req->done)(c, NULL, req->arg);
+		free(req);
+	}
+	if (error != 0 && cf->status != NULL)
+		(*cf->status)(c, error);
+	c->flags = (c->flags & ~ICTRL_SF_BUSY) | busy;
+}
+
+static void
+ictrl_client_free(struct ictrl_session *c)
+{
+	struct ictrl_state *ctrl = c->state;
+
+	ictrl_worker_fini(&ctrl->worker);
+	free(c->cold->reqtab);
+	free(c->cold);
+	free(c);
+	free(ctrl);
+}
+
+/*
+ * API for both server and client
+ */
+
+#define CTRLARGV(x...)	((struct iovec []){ x })
+
+int
+ictrl_build(struct ictrl_session *c, u_int16_t type, void *buf, size_t len)
+{
+	return ictrl_buildv(c, type, 1, CTRLARGV({ buf, len }));
+}
+
+int
+ictrl_buildv(struct ictrl_session *c, u_int16_t type, int argc,
+    struct iovec *argv)
+{
+	/* On the server, a reply built from proc carries the request id. */
+	return ictrl_enqueue(c, type, (c->flags & ICTRL_SF_CLIENT) ? 0 :
+	    c->reqid, -1, argc, argv);
+}
+
+/*
+ * Build a message passing descriptor fd along, e.g. a sealed memory
+ * object from cbuf_memcreate().  The session owns fd from then on and
+ * closes it once sent; on failure it stays with the caller.
+ */
+int
+ictrl_buildfd(struct ictrl_session *c, u_int16_t type, int fd, int argc,
+    struct iovec *argv)
+{
+	return ictrl_enqueue(c, type, (c->flags & ICTRL_SF_CLIENT) ? 0 :
+	    c->reqid, fd, argc, argv);
+}
+
+/*
+ * Reply to req outside of proc, e.g. after deferred work; the reply
+ * carries the id of req, if any.
+ */
+int
+ictrl_reply(struct ictrl_session *c, struct cbuf *req, u_int16_t type,
+    void *buf, size_t len)
+{
+	return ictrl_replyv(c, req, type, 1, CTRLARGV({ buf, len }));
+}
+
+int
+ictrl_replyv(struct ictrl_session *c, struct cbuf *req, u_int16_t type,
+    int argc, struct iovec *argv)
+{
+	return ictrl_enqueue(c, type, req->id, -1, argc, argv);
+}
+
+/*
+ * Build a message in place: parts with a NULL iov_base are reserved
+ * in the message block, for the caller to fill through cbuf->iov[]
+ * before queueing it with ictrl_commit(), which saves building them
+ * elsewhere first.  The others are copied as by ictrl_buildv().
+ * Returns as ictrl_buildv() does; *cbufp is only set on 0.
+ */
+int
+ictrl_reserve(struct ictrl_session *c, u_int16_t type, int argc,
+    struct iovec *argv, struct cbuf **cbufp)
+{
+	struct cbuf *cbuf;
+	int error;
+
+	if ((error = ictrl_room(c)) != 0)
+		return error;
+	cbuf = cbuf_compose(c->worker->pool, type,
+	    (c->flags & ICTRL_SF_CLIENT) ? 0 : c->reqid, argc, argv);
 	if (cbuf == NULL)
 		return -1;
-	cmh = cbuf_getbuf(cbuf, NULL, 0);
-	cmh->type = type;
+	*cbufp = cbuf;
+	return 0;
+}
+
+/*
+ * Queue a message from ictrl_reserve(), once filled.  It is freed if
+ * the session has closed since.
+ */
+int
+ictrl_commit(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	if (c->flags & ICTRL_SF_CLOSED) {
+		cbuf_free(cbuf);
+		return -1;
+	}
+	ictrl_push(c, cbuf);
+	return 0;
+}
+
+/*
+ * Subscribe to topic, for ictrl_publish().  A server session is added
+ * to the index at once; a client asks the server with ICTRL_T_SUB,
+ * which is not answered.
+ */
+int
+ictrl_subscribe(struct ictrl_session *c, u_int32_t topic)
+{
+	if ((c->flags & ICTRL_SF_CLIENT) || c->fd == -1)
+		return ictrl_enqueue(c, ICTRL_T_SUB, 0, -1, 1,
+		    CTRLARGV({ &topic, sizeof(topic) }));
+	return ictrl_topic_add(c, topic);
+}
+
+int
+ictrl_unsubscribe(struct ictrl_session *c, u_int32_t topic)
+{
+	struct ictrl_sub *s;
+
+	if ((c->flags & ICTRL_SF_CLIENT) || c->fd == -1)
+		return ictrl_enqueue(c, ICTRL_T_UNSUB, 0, -1, 1,
+		    CTRLARGV({ &topic, sizeof(topic) }));
+	if (c->cold == NULL)
+		return 0;
+	TAILQ_FOREACH(s, &c->cold->subs, sentry)
+		if (s->topic->topic == topic) {
+			ictrl_topic_del(c, s);
+			break;
+		}
+	return 0;
+}
+
+/*
+ * Returns 0, or -1 if the message cannot be queued: with errno EAGAIN
+ * if the channel is at hiwat, and cf->drain is called once it is back
+ * down.
+ */
+static int
+ictrl_room(struct ictrl_session *c)
+{
+	struct ictrl_config *cf = c->state->config;
+
+	if (c->flags & ICTRL_SF_CLOSED)
+		return -1;
+	if (cf->hiwat > 0 && c->qbytes >= cf->hiwat) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+ictrl_enqueue(struct ictrl_session *c, u_int16_t type, u_int32_t id,
+    int fd, int argc, struct iovec *argv)
+{
+	struct cbuf *cbuf;
+	int error;
+
+	if ((error = ictrl_room(c)) != 0)
+		return error;
+	/* Descriptors only pass over the socket. */
+	if (fd != -1 && c->ring != NULL)
+		return -1;
+
+	cbuf = cbuf_compose(c->worker->pool, type, id, argc, argv);
+	if (cbuf == NULL)
+		return -1;
+	if (fd != -1)
+		cbuf_addfd(cbuf, fd);
+
+	ictrl_push(c, cbuf);
+	return 0;
+}
+
+/*
+ * Queue a built message on the channel.
+ */
+static void
+ictrl_push(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ictrl_config *cf = c->state->config;
 
-	TAILQ_INSERT_TAIL(&c->channel, cbuf, entry);
+	ictrl_queue(c, cbuf);
+	if (cf->hiwat > 0 && c->qbytes >= cf->hiwat)
+		ictrl_server_wat(c);
+	ictrl_session_touch(c);
 
 	/*
-	 * Schedule a next event for server.
+	 * Schedule a next event for server, unless we are in dispatch,
+	 * which sends on its way out, or still connecting.
 	 */
-	if (c->fd != -1)
+	if (c->fd != -1 &&
+	    (c->flags & (ICTRL_SF_BUSY | ICTRL_SF_CONNECTING)) == 0)
 		ictrl_server_trigger(c);
+}
 
-	return 0;
+/*
+ * Channel accounting.  Bytes are those of the message blocks, which is
+ * what a session ties up, not what goes on the wire; a view counts as
+ * the message it holds on to.
+ */
+#define	ICTRL_QSIZE(cbuf)						\
+	((cbuf)->ref != NULL ? (cbuf)->ref->size : (cbuf)->size)
+
+static void
+ictrl_queue(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	TAILQ_INSERT_TAIL(&c->channel, cbuf, entry);
+	c->qbytes += ICTRL_QSIZE(cbuf);
+	c->qmsgs++;
+	c->worker->stats.queued += ICTRL_QSIZE(cbuf);
+}
+
+static void
+ictrl_dequeue(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	TAILQ_REMOVE(&c->channel, cbuf, entry);
+	c->qbytes -= ICTRL_QSIZE(cbuf);
+	c->qmsgs--;
+	c->worker->stats.queued -= ICTRL_QSIZE(cbuf);
+	cbuf_free(cbuf);
+}
+
+/*
+ * Traffic counters, of the session and of its worker.  Called once per
+ * batch, not per message.
+ */
+static void
+ictrl_count_in(struct ictrl_session *c, int msgs, size_t bytes)
+{
+	struct ictrl_stats *st = &c->worker->stats;
+
+	c->stats.msgs_in += msgs;
+	c->stats.bytes_in += bytes;
+	st->msgs_in += msgs;
+	st->bytes_in += bytes;
+}
+
+static void
+ictrl_count_out(struct ictrl_session *c, int msgs, size_t bytes)
+{
+	struct ictrl_stats *st = &c->worker->stats;
+
+	c->stats.msgs_out += msgs;
+	c->stats.bytes_out += bytes;
+	st->msgs_out += msgs;
+	st->bytes_out += bytes;
+}
+
+static int
+ictrl_batch(int n)
+{
+	if (n <= 0)
+		return ICTRL_BATCH;
+	if (n > ICTRL_BATCH_MAX)
+		return ICTRL_BATCH_MAX;
+	return n;
+}
+
+/*
+ * Receive up to n messages with one recvmmsg(2).  Fragments are
+ * reassembled, unless config->chunk takes them one by one.  Passed
+ * descriptors end up in the cbufs.  Returns the number of messages
+ * stored in cbufs, 0 if none is complete, or -1 on EOF or error.
+ */
+int
+ictrl_recvv(struct ictrl_session *c, struct cbuf **cbufs, int n)
+{
+	struct mmsghdr msgs[ICTRL_BATCH_MAX];
+	struct iovec iov[ICTRL_BATCH_MAX];
+	union ictrl_cmsgbuf cmsg[ICTRL_BATCH_MAX];
+	struct cbuf *raw[ICTRL_BATCH_MAX];
+	struct cbuf_pool *pool = c->worker->pool;
+	struct cbuf *cbuf;
+	size_t bytes = 0;
+	int fd = (c->fd != -1) ? c->fd : c->state->fd;
+	int i, j = 0, m = 0, eof = 0;
+
+	/*
+	 * With rings, the socket only has the EOF to tell.  The blocking
+	 * client waits on the doorbell instead.
+	 */
+	if (c->ring != NULL) {
+		while ((j = ictrl_ring_recvv(c, cbufs, n)) == 0 && c->fd == -1)
+			if (ictrl_ring_wait(c) == -1)
+				return -1;
+		if (j != 0)
+			return j;
+	}
+
+	n = MIN(n, ICTRL_BATCH_MAX);
+	for (i = 0; i < n; i++) {
+		if ((raw[i] = cbuf_get(pool, CBUF_BUF_SIZE)) == NULL)
+			break;
+		bzero(&msgs[i], sizeof(msgs[i]));
+		iov[i].iov_base = raw[i]->data;
+		iov[i].iov_len = CBUF_BUF_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = &cmsg[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsg[i]);
+	}
+	if ((n = i) == 0)
+		return -1;
+
+	/* Blocking sockets wait for the first message only. */
+	if ((m = recvmmsg(fd, msgs, n, MSG_WAITFORONE | MSG_CMSG_CLOEXEC,
+	    NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			goto fail;
+		m = 0;
+	}
+
+	for (i = 0; i < m; i++) {
+		/* A zero-length read is EOF; report it on the next call. */
+		if (msgs[i].msg_len == 0) {
+			eof = 1;
+			break;
+		}
+		bytes += msgs[i].msg_len;
+		if (c->state->config->flags & ICTRL_F_ZEROCOPY) {
+			cbuf = raw[i];
+			raw[i] = NULL;
+			if (cbuf_parse(cbuf, msgs[i].msg_len) == -1) {
+				cbuf_free(cbuf);
+				cbuf = NULL;
+			}
+		} else {
+			/* Copy into a right-sized block. */
+			cbuf = cbuf_decompose(pool, raw[i]->data,
+			    msgs[i].msg_len);
+		}
+		if (ictrl_fds(&msgs[i].msg_hdr, cbuf) == -1 || cbuf == NULL) {
+			if (cbuf != NULL)
+				cbuf_free(cbuf);
+			else
+				c->worker->stats.decode_fail++;
+			goto fail;
+		}
+		if (cbuf->flags & CBUF_F_FRAG) {
+			switch (ictrl_reasm(c, &cbuf)) {
+			case -1:
+				goto fail;
+			case 0:
+				continue;
+			}
+		}
+		cbufs[j++] = cbuf;
+	}
+
+	for (i = 0; i < n; i++)
+		if (raw[i] != NULL)
+			cbuf_free(raw[i]);
+	if (eof && j == 0)
+		return -1;
+	ictrl_count_in(c, j, bytes);
+	return j;
+
+fail:
+	/* Close the descriptors of what was received but not taken. */
+	for (i = 0; i < m; i++)
+		ictrl_fds(&msgs[i].msg_hdr, NULL);
+	for (i = 0; i < n; i++)
+		if (raw[i] != NULL)
+			cbuf_free(raw[i]);
+	while (j > 0)
+		cbuf_free(cbufs[--j]);
+	return -1;
+}
+
+/*
+ * Move the descriptors passed with msg to cbuf, or close them if cbuf
+ * is NULL; either way msg is left without any.  Returns -1 if some were
+ * lost to truncation or are more than a cbuf holds.
+ */
+static int
+ictrl_fds(struct msghdr *msg, struct cbuf *cbuf)
+{
+	struct cmsghdr *cmsg;
+	int *fds, error = 0;
+	size_t i, nfds;
+
+	if (msg->msg_flags & MSG_CTRUNC)
+		error = -1;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *)CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			if (cbuf != NULL && cbuf_addfd(cbuf, fds[i]) == 0)
+				continue;
+			if (cbuf != NULL)
+				error = -1;
+			close(fds[i]);
+		}
+	}
+	msg->msg_controllen = 0;
+	return error;
+}
+
+/*
+ * Feed a fragment to the session's reassembly.  Returns 1 with the
+ * complete message in *cbufp, 0 if the fragment was taken and more are
+ * due, or -1 if the message is malformed or over maxmsg.  With a chunk
+ * callback, servers get fragments as they come instead.
+ */
+static int
+ictrl_reasm(struct ictrl_session *c, struct cbuf **cbufp)
+{
+	struct ictrl_config *cf = c->state->config;
+	size_t max;
+	int r;
+
+	if (cf->chunk != NULL && !(c->flags & ICTRL_SF_CLIENT))
+		return 1;
+
+	max = (cf->maxmsg > 0) ? cf->maxmsg : ICTRL_MAXMSG;
+	r = cbuf_reasm(&c->rasm, *cbufp, max);
+	cbuf_free(*cbufp);
+	*cbufp = NULL;
+	switch (r) {
+	case -1:
+		c->worker->stats.decode_fail++;
+		if (c->rasm != NULL) {
+			cbuf_free(c->rasm);
+			c->rasm = NULL;
+		}
+		break;
+	case 1:
+		*cbufp = c->rasm;
+		c->rasm = NULL;
+		break;
+	}
+	return r;
 }
 
+/*
+ * Send as much of the channel as the socket takes, up to sndbatch
+ * datagrams per sendmmsg(2); large messages go out as a run of
+ * fragments, their descriptors with the first one.  Returns EAGAIN if
+ * messages are left.
+ */
 int
 ictrl_send(struct ictrl_session *c)
 {
+	struct mmsghdr msgs[ICTRL_BATCH_MAX];
+	struct iovec fiov[ICTRL_BATCH_MAX][2];
+	char fhdr[ICTRL_BATCH_MAX][CBUF_FRAG_HDRMAX];
+	union ictrl_cmsgbuf cmsg[ICTRL_BATCH_MAX];
+	size_t flen[ICTRL_BATCH_MAX];
 	struct cbuf *cbuf;
+	size_t bytes, off;
+	int fd = (c->fd != -1) ? c->fd : c->state->fd;
+	int batch, i, j, k, n;
 
-	if ((cbuf = TAILQ_FIRST(&c->channel)) != NULL) {
-		struct msghdr msg;
-		int fd = (c->fd != -1) ? c->fd : c->state->fd;
+	if (c->ring != NULL) {
+		/* The blocking client waits for room. */
+		while ((n = ictrl_ring_send(c)) == EAGAIN && c->fd == -1)
+			if (ictrl_ring_wait(c) == -1)
+				return -1;
+		return n;
+	}
 
-		bzero(&msg, sizeof(msg));
-		msg.msg_iov = cbuf->iov;
-		msg.msg_iovlen = cbuf->iovlen;
-		if (sendmsg(fd, &msg, 0) == -1) {
-			if (errno == EAGAIN || errno == ENOBUFS)
+	batch = ictrl_batch(c->state->config->sndbatch);
+	while (!TAILQ_EMPTY(&c->channel)) {
+		i = 0;
+		TAILQ_FOREACH(cbuf, &c->channel, entry) {
+			if (i == batch)
+				break;
+			if ((cbuf->flags & CBUF_F_FRAG) == 0) {
+				bzero(&msgs[i], sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_iov = cbuf->iov;
+				msgs[i].msg_hdr.msg_iovlen = cbuf->iovlen;
+				if (cbuf->nfds > 0)
+					ictrl_cmsg(&msgs[i].msg_hdr, &cmsg[i],
+					    cbuf);
+				flen[i++] = 0;
+				continue;
+			}
+			for (off = cbuf->off; off < cbuf->frag->total &&
+			    i < batch; i++) {
+				flen[i] = cbuf_fragment(cbuf, off, fhdr[i],
+				    fiov[i]);
+				bzero(&msgs[i], sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_iov = fiov[i];
+				msgs[i].msg_hdr.msg_iovlen = 2;
+				if (off == 0 && cbuf->nfds > 0)
+					ictrl_cmsg(&msgs[i].msg_hdr, &cmsg[i],
+					    cbuf);
+				off += flen[i];
+			}
+		}
+		if ((n = sendmmsg(fd, msgs, i, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				c->worker->stats.snd_full++;
 				return EAGAIN;
+			}
 			return -1;
 		}
-		TAILQ_REMOVE(&c->channel, cbuf, entry);
+		for (k = 0, j = 0, bytes = 0; k < n; k++) {
+			bytes += msgs[k].msg_len;
+			cbuf = TAILQ_FIRST(&c->channel);
+			if (flen[k] != 0) {
+				cbuf->off += flen[k];
+				if (cbuf->off < cbuf->frag->total)
+					continue;
+			}
+			ictrl_dequeue(c, cbuf);
+			j++;
+		}
+		ictrl_count_out(c, j, bytes);
+		/* Short batch; the socket is full. */
+		if (n < i) {
+			c->worker->stats.snd_full++;
+			return EAGAIN;
+		}
 	}
 	return 0;
 }
 
+/*
+ * Pass the descriptors of cbuf with msg.  They stay open until the
+ * cbuf is freed after sending.
+ */
+static void
+ictrl_cmsg(struct msghdr *msg, union ictrl_cmsgbuf *cmsgbuf,
+    struct cbuf *cbuf)
+{
+	struct cmsghdr *cmsg;
+	size_t len = cbuf->nfds * sizeof(int);
+
+	msg->msg_control = cmsgbuf;
+	msg->msg_controllen = CMSG_SPACE(len);
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(len);
+	memcpy(CMSG_DATA(cmsg), cbuf->fds, len);
+}
+
 struct cbuf *
 ictrl_recv(struct ictrl_session *c)
 {
+	struct cbuf *cbuf;
+
+	if (c->cold != NULL &&
+	    (cbuf = TAILQ_FIRST(&c->cold->rcvq)) != NULL) {
+		TAILQ_REMOVE(&c->cold->rcvq, cbuf, entry);
+		return cbuf;
+	}
+
+	for (;;) {
+		while (c->ring != NULL) {
+			switch (ictrl_ring_recvv(c, &cbuf, 1)) {
+			case 1:
+				return cbuf;
+			case -1:
+				return NULL;
+			}
+			if (ictrl_ring_wait(c) == -1)
+				return NULL;
+		}
+		if ((cbuf = ictrl_sock_recv(c)) == NULL)
+			return NULL;
+		/* The server may yet take rings it was too slow to. */
+		if (c->cold == NULL || c->cold->ring == NULL ||
+		    ictrl_client_ringed(c, cbuf) == -1)
+			return cbuf;
+	}
+}
+
+static struct cbuf *
+ictrl_sock_recv(struct ictrl_session *c)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union ictrl_cmsgbuf cmsg;
+	struct cbuf *cbuf, *raw;
 	ssize_t n;
+	size_t bytes = 0;
 	int fd = (c->fd != -1) ? c->fd : c->state->fd;
 
-	if ((n = recv(fd, c->buf, sizeof(c->buf), 0)) == -1 &&
-	    !(errno == EAGAIN || errno == EINTR))
-		return NULL;
+	for (;;) {
+		raw = NULL;
+		iov.iov_base = c->worker->buf;
+		iov.iov_len = sizeof(c->worker->buf);
+		if (c->state->config->flags & ICTRL_F_ZEROCOPY) {
+			/*
+			 * Receive straight into a pooled block and hand it
+			 * out as is; the block goes back to the pool when
+			 * the handler frees the cbuf.
+			 */
+			if ((raw = cbuf_get(c->worker->pool,
+			    CBUF_BUF_SIZE)) == NULL)
+				return NULL;
+			iov.iov_base = raw->data;
+		}
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &cmsg;
+		msg.msg_controllen = sizeof(cmsg);
+		if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+			if (raw != NULL)
+				cbuf_free(raw);
+			return NULL;
+		}
+		bytes += n;
+		if (raw == NULL)
+			cbuf = cbuf_decompose(c->worker->pool, c->worker->buf,
+			    n);
+		else if (cbuf_parse(raw, n) == 0)
+			cbuf = raw;
+		else {
+			cbuf_free(raw);
+			cbuf = NULL;
+		}
+		if (ictrl_fds(&msg, cbuf) == -1 || cbuf == NULL) {
+			if (cbuf != NULL)
+				cbuf_free(cbuf);
+			else
+				c->worker->stats.decode_fail++;
+			return NULL;
+		}
+		if ((cbuf->flags & CBUF_F_FRAG) == 0)
+			break;
+		switch (ictrl_reasm(c, &cbuf)) {
+		case -1:
+			return NULL;
+		case 0:
+			continue;
+		}
+		break;
+	}
+	ictrl_count_in(c, 1, bytes);
+	return cbuf;
+}
+
+/*
+ * Shared memory rings.  A blocking client with ICTRL_F_RING offers a
+ * pair of rings with ICTRL_T_RING right after connecting, passing the
+ * memory object and both doorbells.  A server with ICTRL_F_RING maps
+ * them and says so over the socket; from then on the messages of the
+ * session go through the rings, and the socket is only kept to see the
+ * peer go away.  Where either side cannot, the session stays on the
+ * socket.  The client waits ICTRL_RINGWAIT ms for the answer, then
+ * goes on on the socket; should the answer come later, ictrl_recv()
+ * takes it then.  Other messages that come in meanwhile are kept for
+ * ictrl_recv().
+ */
+
+static int
+ictrl_client_ring(struct ictrl_session *c)
+{
+	struct ictrl_config *cf = c->state->config;
+	struct ictrl_session_cold *cc;
+	struct ring_end *r;
+	struct cbuf *cbuf;
+	struct pollfd pfd;
+	struct timespec t0, t1;
+	u_int32_t size;
+	int fd, ms;
+
+	if ((cc = ictrl_session_cold(c)) == NULL)
+		return -1;
+	size = (cf->ringsize > 0) ? cf->ringsize : ICTRL_RINGSIZE;
+	if ((r = malloc(sizeof(*r))) == NULL)
+		return -1;
+	if (ring_create(r, size, &fd) == -1) {
+		free(r);
+		return -1;
+	}
+	cbuf = cbuf_compose(c->worker->pool, ICTRL_T_RING, 0, 1,
+	    CTRLARGV({ &size, sizeof(size) }));
+	if (cbuf == NULL) {
+		close(fd);
+		goto fail;
+	}
+	/* The server's doorbell, then ours. */
+	cbuf_addfd(cbuf, fd);
+	cbuf_addfd(cbuf, fcntl(r->peer, F_DUPFD_CLOEXEC, 0));
+	cbuf_addfd(cbuf, fcntl(r->efd, F_DUPFD_CLOEXEC, 0));
+	if (cbuf->fds[1] == -1 || cbuf->fds[2] == -1) {
+		cbuf_free(cbuf);
+		goto fail;
+	}
+	ictrl_queue(c, cbuf);
+	if (ictrl_send(c) != 0)
+		goto fail;
+	cc->ring = r;
+
+	pfd.fd = (c->fd != -1) ? c->fd : c->state->fd;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ms = ICTRL_RINGWAIT - (t1.tv_sec - t0.tv_sec) * 1000 -
+		    (t1.tv_nsec - t0.tv_nsec) / 1000000;
+		if (ms <= 0)
+			return -1;
+		switch (poll(&pfd, 1, ms)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			/* FALLTHROUGH */
+		case 0:
+			return -1;
+		}
+		if ((cbuf = ictrl_sock_recv(c)) == NULL) {
+			cc->ring = NULL;
+			goto fail;
+		}
+		if (ictrl_client_ringed(c, cbuf) == -1)
+			TAILQ_INSERT_TAIL(&cc->rcvq, cbuf, entry);
+		else
+			return (c->ring != NULL) ? 0 : -1;
+	}
+
+fail:
+	ring_destroy(r);
+	free(r);
+	return -1;
+}
+
+/*
+ * Take the server's answer to the rings offered, and move the session
+ * onto them if it took them.  Returns -1 if cbuf is something else.
+ */
+static int
+ictrl_client_ringed(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ring_end *r = c->cold->ring;
+	struct cbuf_msghdr *cmh;
+	u_int32_t status;
+	size_t len;
+	void *p;
+
+	cmh = cbuf_getbuf(cbuf, NULL, 0);
+	if (cmh->type != ICTRL_T_RING)
+		return -1;
+	p = cbuf_getbuf(cbuf, &len, 1);
+	if (p != NULL && len >= sizeof(status))
+		memcpy(&status, p, sizeof(status));
+	else
+		status = EPROTO;
+	cbuf_free(cbuf);
+	c->cold->ring = NULL;
+	if (status != 0) {
+		ring_destroy(r);
+		free(r);
+	} else
+		c->ring = r;
+	return 0;
+}
+
+static void
+ictrl_server_ring(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ictrl_config *cf = c->state->config;
+	struct ictrl_worker *w = c->worker;
+	struct ring_end *r = NULL;
+	u_int32_t size, status = 0;
+	size_t len;
+	void *p;
+
+	p = cbuf_getbuf(cbuf, &len, 1);
+	if ((cf->flags & ICTRL_F_RING) == 0 || c->ring != NULL)
+		status = EOPNOTSUPP;
+	else if (p == NULL || len < sizeof(size) || cbuf->nfds != 3 ||
+	    !TAILQ_EMPTY(&c->channel))
+		status = EINVAL;
+	else if (ictrl_session_cold(c) == NULL ||
+	    (r = malloc(sizeof(*r))) == NULL)
+		status = ENOMEM;
+	else {
+		memcpy(&size, p, sizeof(size));
+		if (ring_attach(r, cbuf_getfd(cbuf, 0), cbuf_getfd(cbuf, 1),
+		    cbuf_getfd(cbuf, 2), size) == -1) {
+			if ((status = errno) == 0)
+				status = EINVAL;
+			free(r);
+			r = NULL;
+		}
+	}
+	cbuf_free(cbuf);
+
+	/* The answer goes over the socket, before the rings take over. */
+	if (ictrl_build(c, ICTRL_T_RING, &status, sizeof(status)) == -1 ||
+	    ictrl_send(c) != 0) {
+		if (r != NULL) {
+			ring_destroy(r);
+			free(r);
+		}
+		shutdown(c->fd, SHUT_RDWR);
+		return;
+	}
+	if (r == NULL)
+		return;
+
+	c->ring = r;
+	ictrl_event_set(w, &c->cold->evd, r->efd, EV_READ | EV_PERSIST,
+	    ictrl_server_dispatch, c);
+	event_add(&c->cold->evd, NULL);
+	w->stats.ev_add++;
+	/* Have the client ring us for its first message. */
+	if (ring_sleep(r))
+		ring_kick(r->efd);
+}
+
+/*
+ * ICTRL_T_SUB and ICTRL_T_UNSUB carry an array of topics.  Failures are
+ * only logged, as the client does not wait for an answer.
+ */
+static void
+ictrl_server_sub(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct cbuf_msghdr *cmh = cbuf_getbuf(cbuf, NULL, 0);
+	u_int32_t topic;
+	size_t i, len;
+	char *p;
+
+	if ((p = cbuf_getbuf(cbuf, &len, 1)) == NULL)
+		len = 0;
+	for (i = 0; i + sizeof(topic) <= len; i += sizeof(topic)) {
+		memcpy(&topic, p + i, sizeof(topic));
+		if (cmh->type == ICTRL_T_UNSUB)
+			(void)ictrl_unsubscribe(c, topic);
+		else if (ictrl_subscribe(c, topic) == -1)
+			log_debug("%s: topic %u: %s", __func__, topic,
+			    strerror(errno));
+	}
+	cbuf_free(cbuf);
+}
+
+/*
+ * Answer ICTRL_T_STATS with a snapshot of the server's counters and
+ * those of the session.
+ */
+static void
+ictrl_server_stat(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	struct ictrl_stats st;
+	struct ictrl_session_stats sst = c->stats;
+
+	ictrl_server_stats(c->state, &st);
+	if (ictrl_replyv(c, cbuf, ICTRL_T_STATS, 2, CTRLARGV(
+	    { &st, sizeof(st) }, { &sst, sizeof(sst) })) == -1)
+		log_debug("%s: %s", __func__, strerror(errno));
+	cbuf_free(cbuf);
+}
+
+/*
+ * Pass a message to the handler of its type, checked against its
+ * limits, or else to proc.  What neither takes is refused.
+ */
+static void
+ictrl_server_proc(struct ictrl_session *c, struct cbuf *cbuf,
+    u_int16_t type)
+{
+	struct ictrl_state *ctrl = c->state;
+	struct ictrl_worker *w = c->worker;
+	struct ictrl_handler *h;
+	struct ictrl_handler_stats *hs, none;
+	struct timespec t0, t1;
+	unsigned int parts = cbuf->iovlen - 1;
+	int error = 0;
+
+	if (type >= ctrl->nhandlers || ctrl->handlers[type].fn == NULL) {
+		if (ctrl->config->proc != NULL)
+			(*ctrl->config->proc)(c, cbuf);
+		else
+			ictrl_server_error(c, cbuf, type, EOPNOTSUPP);
+		return;
+	}
+	h = &ctrl->handlers[type];
+	if (type < w->nhstats)
+		hs = &w->hstats[type];
+	else {
+		bzero(&none, sizeof(none));	/* not counted */
+		hs = &none;
+	}
+
+	if ((h->maxparts > 0 && parts > h->maxparts) ||
+	    (h->maxlen > 0 && cbuf->len > h->maxlen))
+		error = EMSGSIZE;
+	else if (parts < h->minparts || cbuf->len < h->minlen)
+		error = EINVAL;
+	if (error != 0) {
+		hs->rejects++;
+		ictrl_server_error(c, cbuf, type, error);
+		return;
+	}
+
+	hs->calls++;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	errno = 0;
+	if ((*h->fn)(c, cbuf) == -1) {
+		error = (errno != 0) ? errno : EIO;
+		hs->errors++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	hs->ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+	    t1.tv_nsec - t0.tv_nsec;
+	if (error != 0)
+		ictrl_server_error(c, cbuf, type, error);
+	else
+		cbuf_free(cbuf);
+}
 
-	if (n == 0)
+/*
+ * Refuse a request with ICTRL_T_ERROR, carrying its id, and free it.
+ */
+static void
+ictrl_server_error(struct ictrl_session *c, struct cbuf *cbuf,
+    u_int16_t type, int error)
+{
+	struct ictrl_error e;
+
+	bzero(&e, sizeof(e));
+	e.type = type;
+	e.error = error;
+	if (ictrl_reply(c, cbuf, ICTRL_T_ERROR, &e, sizeof(e)) == -1)
+		log_debug("%s: %s", __func__, strerror(errno));
+	cbuf_free(cbuf);
+}
+
+static struct ictrl_topic *
+ictrl_topic_find(struct ictrl_worker *w, u_int32_t topic)
+{
+	struct ictrl_topic *t;
+
+	if (w->topics == NULL)
 		return NULL;
+	LIST_FOREACH(t, &w->topics[topic & (ICTRL_TOPICHASH - 1)], entry)
+		if (t->topic == topic)
+			return t;
+	return NULL;
+}
+
+static int
+ictrl_topic_add(struct ictrl_session *c, u_int32_t topic)
+{
+	struct ictrl_worker *w = c->worker;
+	struct ictrl_session_cold *cc;
+	struct ictrl_topic *t;
+	struct ictrl_sub *s;
+
+	if ((cc = ictrl_session_cold(c)) == NULL)
+		return -1;
+	TAILQ_FOREACH(s, &cc->subs, sentry)
+		if (s->topic->topic == topic)
+			return 0;
+	if (cc->nsubs >= ICTRL_MAXSUBS) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (w->topics == NULL && (w->topics = calloc(ICTRL_TOPICHASH,
+	    sizeof(*w->topics))) == NULL)
+		return -1;
+	if ((s = malloc(sizeof(*s))) == NULL)
+		return -1;
+	if ((t = ictrl_topic_find(w, topic)) == NULL) {
+		if ((t = malloc(sizeof(*t))) == NULL) {
+			free(s);
+			return -1;
+		}
+		t->topic = topic;
+		TAILQ_INIT(&t->subs);
+		LIST_INSERT_HEAD(&w->topics[topic & (ICTRL_TOPICHASH - 1)], t,
+		    entry);
+	}
+	s->topic = t;
+	s->session = c;
+	TAILQ_INSERT_TAIL(&t->subs, s, entry);
+	TAILQ_INSERT_TAIL(&cc->subs, s, sentry);
+	cc->nsubs++;
+	return 0;
+}
+
+static void
+ictrl_topic_del(struct ictrl_session *c, struct ictrl_sub *s)
+{
+	struct ictrl_topic *t = s->topic;
+
+	TAILQ_REMOVE(&t->subs, s, entry);
+	TAILQ_REMOVE(&c->cold->subs, s, sentry);
+	c->cold->nsubs--;
+	free(s);
+	if (TAILQ_EMPTY(&t->subs)) {
+		LIST_REMOVE(t, entry);
+		free(t);
+	}
+}
+
+/*
+ * Take up to n messages off the receive ring, polling an empty ring
+ * ringspin times first.  Each is copied out into a block of its own
+ * before it is parsed.  The doorbell is armed whenever the ring is
+ * found drained.
+ */
+static int
+ictrl_ring_recvv(struct ictrl_session *c, struct cbuf **cbufs, int n)
+{
+	struct ictrl_config *cf = c->state->config;
+	struct ring_end *r = c->ring;
+	struct cbuf *cbuf;
+	ssize_t len;
+	size_t bytes = 0;
+	int i, j = 0;
+
+again:
+	while (j < n) {
+		if ((cbuf = cbuf_get(c->worker->pool, CBUF_BUF_SIZE)) == NULL)
+			goto fail;
+		if ((len = ring_get(r, cbuf->data, CBUF_BUF_SIZE)) <= 0) {
+			cbuf_free(cbuf);
+			if (len == -1) {
+				c->worker->stats.decode_fail++;
+				goto fail;
+			}
+			break;
+		}
+		bytes += len;
+		if (cbuf_parse(cbuf, len) == -1) {
+			cbuf_free(cbuf);
+			c->worker->stats.decode_fail++;
+			goto fail;
+		}
+		if (cbuf->flags & CBUF_F_FRAG) {
+			switch (ictrl_reasm(c, &cbuf)) {
+			case -1:
+				goto fail;
+			case 0:
+				continue;
+			}
+		}
+		cbufs[j++] = cbuf;
+	}
+	if (j < n) {
+		for (i = 0; j == 0 && i < cf->ringspin; i++)
+			if (ring_ready(r))
+				goto again;
+		if (ring_sleep(r))
+			goto again;
+	}
+	ring_notify(r);
+	ictrl_count_in(c, j, bytes);
+	return j;
+
+fail:
+	while (j > 0)
+		cbuf_free(cbufs[--j]);
+	return -1;
+}
+
+/*
+ * Move the channel onto the send ring.  Returns EAGAIN if it is full;
+ * the peer rings the doorbell once it has made room.
+ */
+static int
+ictrl_ring_send(struct ictrl_session *c)
+{
+	struct ring_end *r = c->ring;
+	struct cbuf *cbuf;
+	struct iovec iov[2];
+	char hdr[CBUF_FRAG_HDRMAX];
+	size_t bytes = 0, len;
+	int error, n;
 
-	return cbuf_decompose(c->buf, n);
+	while ((cbuf = TAILQ_FIRST(&c->channel)) != NULL) {
+		if ((cbuf->flags & CBUF_F_FRAG) == 0) {
+			if ((n = ring_put(r, cbuf->iov, cbuf->iovlen)) == -1)
+				goto full;
+			bytes += n;
+		} else {
+			while (cbuf->off < cbuf->frag->total) {
+				len = cbuf_fragment(cbuf, cbuf->off, hdr, iov);
+				if ((n = ring_put(r, iov, 2)) == -1)
+					goto full;
+				bytes += n;
+				cbuf->off += len;
+			}
+		}
+		ictrl_dequeue(c, cbuf);
+		ictrl_count_out(c, 1, 0);
+	}
+	ring_notify(r);
+	ictrl_count_out(c, 0, bytes);
+	return 0;
+
+full:
+	error = (errno == EAGAIN) ? EAGAIN : -1;
+	if (error == EAGAIN)
+		c->worker->stats.snd_full++;
+	ring_notify(r);
+	ictrl_count_out(c, 0, bytes);
+	return error;
+}
+
+/*
+ * Block on the doorbell; blocking client only.  The socket is watched
+ * too, for the server going away.
+ */
+static int
+ictrl_ring_wait(struct ictrl_session *c)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = c->ring->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = c->state->fd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[1].revents != 0)
+			return -1;
+		if (pfd[0].revents & POLLIN)
+			break;
+	}
+	ring_wake(c->ring);
+	return 0;
 }
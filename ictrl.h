@@ -20,36 +20,270 @@
 #include <sys/queue.h>
 
 #include <event.h>
+#include <pthread.h>
 
 #include "buf.h"
+#include "ring.h"
 
 #define	ictrl_msghdr	cbuf_msghdr
 
+#define	ICTRL_BATCH		32	/* default messages per syscall */
+#define	ICTRL_BATCH_MAX		64
+#define	ICTRL_BUDGET		128	/* default messages per wakeup */
+#define	ICTRL_ACCEPTMAX		32	/* default accepts per wakeup */
+#define	ICTRL_REQHASH		256	/* in-flight table buckets */
+#define	ICTRL_MAXMSG		(16 * 1024 * 1024)	/* default maxmsg */
+#define	ICTRL_RINGSIZE		(1024 * 1024)	/* default ring size */
+#define	ICTRL_RINGWAIT		1000	/* ms for the server to take rings */
+#define	ICTRL_TOPICHASH		256	/* topic index buckets */
+#define	ICTRL_MAXSUBS		256	/* topics per session */
+#define	ICTRL_SLAB		64	/* sessions per pool chunk */
+#define	ICTRL_TICK		100	/* timer wheel tick, ms */
+#define	ICTRL_WHEEL		512	/* timer wheel slots */
+#define	ICTRL_URINGBUFS		128	/* receive buffers per worker */
+
+/*
+ * Applications have types 0x0000 to 0x1eff.  Those from
+ * ICTRL_T_RESERVED to 0x1fff are the library's own; the server handles
+ * them itself and never passes them to handlers or proc.  Bits 0xe000
+ * carry header extensions (CBUF_MSG_FLAGS), so no message has a type
+ * above 0x1fff; cbuf_compose() refuses one.
+ */
+#define	ICTRL_T_RESERVED	0x1f00
+#define	ICTRL_T_RING		0x1f01	/* set up shared memory rings */
+#define	ICTRL_T_SUB		0x1f02	/* subscribe to topics */
+#define	ICTRL_T_UNSUB		0x1f03	/* unsubscribe from topics */
+#define	ICTRL_T_STATS		0x1f04	/* counters of the server and session */
+#define	ICTRL_T_ERROR		0x1f05	/* refused; struct ictrl_error */
+
 struct ictrl_config;
+struct ictrl_handler;
+struct ictrl_handler_stats;
+struct ictrl_req;
 struct ictrl_session;
+struct ictrl_session_cold;
+struct ictrl_slab;
+struct ictrl_sub;
+struct ictrl_topicq;
+struct ictrl_worker;
 struct ictrl_state;
 struct cbuf_msghdr;
+struct uring;
 
 struct ictrl_config {
 	char			*path;
 	int			backlog;
+	int			acceptmax;	/* accepts per wakeup */
+	int			flags;
+#define	ICTRL_F_ZEROCOPY	0x01	/* parts point into receive buffer */
+#define	ICTRL_F_REQID		0x02	/* tag requests; peer must support it */
+#define	ICTRL_F_RING		0x04	/* shared memory rings, if possible */
+#define	ICTRL_F_URING		0x08	/* io_uring, if possible; server only */
+	int			sndbatch;	/* messages per sendmmsg */
+	int			rcvbatch;	/* messages per recvmmsg */
+	int			rcvbudget;	/* messages per wakeup */
+	size_t			maxmsg;		/* reassembly limit */
+	int			nworkers;	/* session threads; 0 none */
+	size_t			ringsize;	/* bytes per ring direction */
+	int			ringspin;	/* polls of an empty ring */
+	size_t			hiwat;		/* queued bytes max; 0 none */
+	size_t			lowat;		/* queued bytes to resume at */
+	int			idletimo;	/* ms idle to close; 0 none */
+	int			reqtimo;	/* ms a request may stall */
+	int			(*shard)(struct ictrl_state *);
 	void			(*proc)(struct ictrl_session *,
 				    struct cbuf *);
+	void			(*status)(struct ictrl_session *, int);
+	/*
+	 * Servers only: each fragment as it comes, its slice of the body
+	 * in iov[1], at an offset into the total.  chunk owns the cbuf
+	 * and must cbuf_free() it; the slice is valid until then.
+	 */
+	void			(*chunk)(struct ictrl_session *,
+				    struct cbuf *, size_t, size_t);
+	void			(*drain)(struct ictrl_session *);
 };
 
+/*
+ * A server may hold many thousands of sessions, mostly idle, so they are
+ * kept small.  What is touched for each message comes first; what only
+ * clients, rings or subscriptions need is in the cold part, allocated
+ * on first use.  Receiving goes through the worker's buffer.  On LP64
+ * with libevent 2, a plain server session costs 408 bytes, taken from
+ * its worker's pool; a cold part adds 328.
+ */
 struct ictrl_session {
 	struct ictrl_state	*state;
-	struct cbufq		channel;
-	char			buf[CBUF_BUF_SIZE];
+	struct ictrl_worker	*worker;
 	int			fd;	/* accept fd; only for server */
-	struct event		ev;	/* dispatch; only for server */
+	int			flags;
+#define	ICTRL_SF_WRITE		0x01	/* evw is added */
+#define	ICTRL_SF_BUSY		0x02	/* in dispatch */
+#define	ICTRL_SF_CLIENT		0x04	/* event-driven client */
+#define	ICTRL_SF_CONNECTING	0x08	/* connect in progress */
+#define	ICTRL_SF_CLOSED		0x10	/* connection is gone */
+#define	ICTRL_SF_FREE		0x20	/* free on return from dispatch */
+#define	ICTRL_SF_HIWAT		0x40	/* channel above hiwat; not reading */
+#define	ICTRL_SF_TIMER		0x80	/* on the timer wheel */
+#define	ICTRL_SF_URECV		0x100	/* io_uring receive in flight */
+#define	ICTRL_SF_UCANCEL	0x200	/* and being cancelled */
+	u_int32_t		reqid;	/* request being handled / last sent */
+	u_int32_t		deadline;	/* tick to time out at */
+	unsigned int		qmsgs;	/* messages queued on channel */
+	u_int32_t		slot;	/* wheel slot it is in */
+	size_t			qbytes;	/* block bytes queued on channel */
+	struct ictrl_session_stats {
+		u_int64_t	msgs_in;
+		u_int64_t	msgs_out;
+		u_int64_t	bytes_in;	/* on the wire */
+		u_int64_t	bytes_out;
+	}			stats;
+	struct cbufq		channel;
+	struct cbuf		*rasm;	/* message being reassembled */
+	struct ring_end		*ring;	/* rings in use, if any */
+	struct ictrl_session_cold *cold;
+	TAILQ_ENTRY(ictrl_session) entry;
+	TAILQ_ENTRY(ictrl_session) tentry;	/* on timer wheel */
+	struct event		evr;	/* read; server and async client */
+	struct event		evw;	/* write; server and async client */
+};
+
+/*
+ * A handler for one message type, registered with ictrl_handle().  The
+ * server checks a message against the limits before calling fn: parts
+ * is the number of parts, len their total bytes, without padding; a
+ * max of 0 is no limit.  The message is freed when fn returns; fn takes
+ * a reference with cbuf_ref() to keep it.  If fn returns -1, the
+ * request is answered with ICTRL_T_ERROR and errno.
+ */
+struct ictrl_handler {
+	int			(*fn)(struct ictrl_session *, struct cbuf *);
+	unsigned int		minparts;
+	unsigned int		maxparts;
+	size_t			minlen;
+	size_t			maxlen;
+};
+
+/*
+ * Calls of a handler.  rejects counts messages that failed its limits
+ * and were not passed to it, errors calls that returned -1, ns the time
+ * spent in it.  Kept by each worker, like struct ictrl_stats.
+ */
+struct ictrl_handler_stats {
+	u_int64_t		calls;
+	u_int64_t		errors;
+	u_int64_t		rejects;
+	u_int64_t		ns;
+};
+
+/*
+ * Body of ICTRL_T_ERROR: the type of the request refused and why.
+ * EOPNOTSUPP if no handler or proc takes the type, EMSGSIZE or EINVAL
+ * if it is out of the handler's limits, or what the handler set.
+ */
+struct ictrl_error {
+	u_int16_t		type;
+	u_int16_t		pad;
+	int32_t			error;
+};
+
+struct ictrl_session_cold {
+	struct event		evt;	/* connect retry; for async client */
+	struct event		evd;	/* ring doorbell; only for server */
+	TAILQ_HEAD(ictrl_reqq, ictrl_req)
+				reqs;	/* replies due; only for async client */
+	struct ictrl_reqq	*reqtab;	/* by id; with ICTRL_F_REQID */
+	TAILQ_HEAD(ictrl_subq, ictrl_sub)
+				subs;	/* topics; only for server */
+	unsigned int		nsubs;
+	struct ring_end		*ring;	/* offered; only for blocking client */
+	struct cbufq		rcvq;	/* received meanwhile; likewise */
+};
+
+/*
+ * Loop counters.  ev_add and ev_del count the event_add(3) and
+ * event_del(3) calls made for sessions; each one is a kernel filter
+ * change on epoll/kqueue.  accept_shed counts connections accepted and
+ * closed at once for lack of descriptors, accept_paused the times
+ * accepting had to be suspended altogether.  bcast_drop counts
+ * broadcasts and publishes not queued on a session, as it was at
+ * hiwat.  Bytes are counted as they go on the wire, fragment headers
+ * included.  snd_full counts sends cut short by a full socket or ring,
+ * i.e. EAGAIN and ENOBUFS.  alloc_fail counts message blocks and
+ * sessions that could not be allocated, decode_fail messages that did
+ * not parse or could not be reassembled; the session is closed on
+ * either.  sessions and queued, the bytes on all channels, are gauges.
+ * Each worker counts its own, with plain increments; a snapshot is the
+ * sum.  ICTRL_T_STATS asks the server for one, along with the
+ * counters of the session asking: the reply has struct ictrl_stats and
+ * struct ictrl_session_stats as its two parts.
+ */
+struct ictrl_stats {
+	u_int64_t		msgs_in;
+	u_int64_t		msgs_out;
+	u_int64_t		ev_add;
+	u_int64_t		ev_del;
+	u_int64_t		accepts;
+	u_int64_t		accept_shed;
+	u_int64_t		accept_paused;
+	u_int64_t		bcast_drop;
+	u_int64_t		bytes_in;
+	u_int64_t		bytes_out;
+	u_int64_t		snd_full;
+	u_int64_t		closes;
+	u_int64_t		timeouts;
+	u_int64_t		alloc_fail;
+	u_int64_t		decode_fail;
+	u_int64_t		sessions;
+	u_int64_t		queued;
+};
+
+/*
+ * An event loop and everything owned by it: sessions, message blocks
+ * and counters.  The state's own worker runs on the caller's loop and
+ * also does the accepting; with nworkers set, accepted descriptors are
+ * handed through a pipe to worker threads, each with its own event
+ * base, as are broadcasts.  A session is only ever touched by the
+ * thread of its worker.
+ */
+struct ictrl_worker {
+	struct ictrl_state	*state;
+	struct event_base	*base;	/* NULL for the caller's loop */
+	pthread_t		thread;
+	int			pipe[2];	/* handoff and broadcasts */
+	struct event		ev;
+	TAILQ_HEAD(, ictrl_session) sessions;
+	unsigned int		nsessions;
+	TAILQ_HEAD(, ictrl_session) sfree;	/* session pool */
+	struct ictrl_slab	*slabs;
+	TAILQ_HEAD(ictrl_wheel, ictrl_session)
+				*wheel;	/* sessions by deadline, if any */
+	u_int32_t		ticks;
+	struct event		evtick;
+	struct cbuf_pool	*pool;	/* message blocks */
+	struct ictrl_topicq	*topics;	/* topic index, once used */
+	struct ictrl_stats	stats;
+	struct ictrl_handler_stats
+				*hstats;	/* by type; nhstats of them */
+	unsigned int		nhstats;
+	struct uring		*uring;	/* NULL for libevent */
+	struct event		evu;	/* uring completions */
+	char			buf[CBUF_BUF_SIZE];	/* receive scratch */
 };
 
 struct ictrl_state {
 	struct ictrl_config	*config;
 	int			fd;	/* socket fd */
+	int			rfd;	/* reserve fd; only for server */
 	struct event		ev;	/* accept; only for server */
 	struct event		evt;	/* accept; only for server */
+	int			uaccept;	/* accept armed; -1 libevent */
+	struct ictrl_worker	worker;
+	struct ictrl_worker	*workers;	/* only for server */
+	int			nworkers;
+	unsigned int		rr;	/* round-robin cursor */
+	struct ictrl_handler	*handlers;	/* by type; only for server */
+	unsigned int		nhandlers;	/* highest type + 1 */
 	void			*v;	/* user data */
 };
 
@@ -58,16 +292,47 @@ struct ictrl_state *
 void		ictrl_server_fini(struct ictrl_state *);
 void		ictrl_server_start(struct ictrl_state *);
 void		ictrl_server_stop(struct ictrl_state *);
+void		ictrl_server_stats(struct ictrl_state *,
+		    struct ictrl_stats *);
+int		ictrl_broadcast(struct ictrl_state *, u_int16_t, int,
+		    struct iovec *);
+int		ictrl_publish(struct ictrl_state *, u_int32_t, u_int16_t, int,
+		    struct iovec *);
+int		ictrl_handle(struct ictrl_state *, u_int16_t,
+		    const struct ictrl_handler *);
+void		ictrl_handler_stats(struct ictrl_state *, u_int16_t,
+		    struct ictrl_handler_stats *);
+int		ictrl_shard_rr(struct ictrl_state *);
+int		ictrl_shard_least(struct ictrl_state *);
 
 struct ictrl_session *
 		ictrl_client_init(struct ictrl_config *);
 void		ictrl_client_fini(struct ictrl_session *);
+struct ictrl_session *
+		ictrl_client_open(struct ictrl_config *, struct event_base *);
+void		ictrl_client_close(struct ictrl_session *);
+/* Only for sessions of ictrl_client_open(); else EINVAL. */
+int		ictrl_request(struct ictrl_session *, u_int16_t, int,
+		    struct iovec *, void (*)(struct ictrl_session *,
+		    struct cbuf *, void *), void *);
 
 int		ictrl_build(struct ictrl_session *, u_int16_t, void *,
 		    size_t);
 int		ictrl_buildv(struct ictrl_session *, u_int16_t, int,
 		    struct iovec *);
+int		ictrl_buildfd(struct ictrl_session *, u_int16_t, int, int,
+		    struct iovec *);
+int		ictrl_reply(struct ictrl_session *, struct cbuf *, u_int16_t,
+		    void *, size_t);
+int		ictrl_replyv(struct ictrl_session *, struct cbuf *, u_int16_t,
+		    int, struct iovec *);
+int		ictrl_reserve(struct ictrl_session *, u_int16_t, int,
+		    struct iovec *, struct cbuf **);
+int		ictrl_commit(struct ictrl_session *, struct cbuf *);
+int		ictrl_subscribe(struct ictrl_session *, u_int32_t);
+int		ictrl_unsubscribe(struct ictrl_session *, u_int32_t);
 int		ictrl_send(struct ictrl_session *);
 struct cbuf	*ictrl_recv(struct ictrl_session *);
+int		ictrl_recvv(struct ictrl_session *, struct cbuf **, int);
 
 #endif /* _ICTRL_ICTRL_H_ */
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>	/* MIN */
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "log.h"
+#include "ring.h"
+
+#define	LOG_RINGSIZE		(256 * 1024)	/* per thread */
+#define	LOG_INTERVAL		10	/* ms between drains */
+#define	LOG_LINEMAX		1024
+
+/*
+ * The ring of a thread that has logged.  Only that thread puts, only
+ * the log thread, or a flush, gets; both under log_mtx, which also
+ * keeps the list.  The ring of an exited thread is freed once drained.
+ */
+struct log_ring {
+	struct ring_end		 ring;
+	TAILQ_ENTRY(log_ring)	 entry;
+	unsigned int		 drops;	/* records lost to a full ring */
+	unsigned int		 dseen;
+	int			 dead;	/* the thread has exited */
+};
+
+extern char		*__progname;
+
+int			 log_verbosity;
+
+static int		 log_tostderr = 1;	/* until log_init() */
+static int		 log_running;
+static pthread_t	 log_thread;
+static pthread_key_t	 log_key;
+static pthread_once_t	 log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t	 log_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, log_ring) log_rings = TAILQ_HEAD_INITIALIZER(log_rings);
+static __thread struct log_ring *log_self;
+
+static void	 log_setup(void);
+static struct log_ring *
+		 log_start(void);
+static void	*log_main(void *);
+static void	 log_drain(void);
+static void	 log_drain_locked(void);
+static void	 log_exit(void *);
+static void	 log_prefork(void);
+static void	 log_postfork(void);
+static void	 log_child(void);
+static void	 log_emit(struct log_rec *);
+static void	 log_format(struct log_rec *, char *, size_t);
+static int	 log_star(struct log_rec *, int *, char *, size_t);
+static int	 log_conv(struct log_rec *, int, const char *, char, char *,
+		    size_t);
+static void	 log_out(int, const char *);
+
+void
+log_init(int debug)
+{
+	log_tostderr = debug;
+	if (!debug)
+		openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+	pthread_once(&log_once, log_setup);
+}
+
+void
+log_verbose(int v)
+{
+	log_verbosity = v;
+}
+
+static void
+log_setup(void)
+{
+	pthread_key_create(&log_key, log_exit);
+	pthread_atfork(log_prefork, log_postfork, log_child);
+	atexit(log_flush);
+}
+
+/*
+ * Queue a record on the ring of the calling thread.  The first call of
+ * a thread sets its ring up, and starts the log thread if need be; if
+ * that fails, the record is written out at once.
+ */
+void
+log_put(struct log_rec *r)
+{
+	struct log_ring *lg = log_self;
+	struct iovec iov[2];
+
+	if (lg == NULL || !log_running) {
+		if ((lg = log_start()) == NULL) {
+			pthread_mutex_lock(&log_mtx);
+			log_emit(r);
+			pthread_mutex_unlock(&log_mtx);
+			return;
+		}
+	}
+	iov[0].iov_base = r;
+	iov[0].iov_len = offsetof(struct log_rec, str);
+	iov[1].iov_base = r->str;
+	iov[1].iov_len = r->slen;
+	if (ring_put(&lg->ring, iov, 2) == -1)
+		__atomic_add_fetch(&lg->drops, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write out all there is, e.g. before exiting.
+ */
+void
+log_flush(void)
+{
+	log_drain();
+}
+
+/*
+ * The last words go out directly, after what was queued before them;
+ * they must not be lost to a full ring.
+ */
+__dead void
+log_fatal(struct log_rec *r)
+{
+	pthread_mutex_lock(&log_mtx);
+	log_drain_locked();
+	log_emit(r);
+	pthread_mutex_unlock(&log_mtx);
+	exit(1);
+}
+
+static struct log_ring *
+log_start(void)
+{
+	struct log_ring *lg;
+	sigset_t set, oset;
+
+	pthread_once(&log_once, log_setup);
+	pthread_mutex_lock(&log_mtx);
+	if ((lg = log_self) == NULL &&
+	    (lg = calloc(1, sizeof(*lg))) != NULL) {
+		if (ring_local(&lg->ring, LOG_RINGSIZE) == -1) {
+			free(lg);
+			lg = NULL;
+		} else {
+			TAILQ_INSERT_TAIL(&log_rings, lg, entry);
+			pthread_setspecific(log_key, lg);
+			log_self = lg;
+		}
+	}
+	if (lg != NULL && !log_running) {
+		/* Signals are for the caller's threads. */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oset);
+		if (pthread_create(&log_thread, NULL, log_main, NULL) == 0) {
+			pthread_detach(log_thread);
+			log_running = 1;
+		} else
+			lg = NULL;
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	}
+	pthread_mutex_unlock(&log_mtx);
+	return lg;
+}
+
+static void *
+log_main(void *v)
+{
+	struct timespec ts = { 0, LOG_INTERVAL * 1000000 };
+
+	for (;;) {
+		log_drain();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static void
+log_drain(void)
+{
+	pthread_mutex_lock(&log_mtx);
+	log_drain_locked();
+	pthread_mutex_unlock(&log_mtx);
+}
+
+static void
+log_drain_locked(void)
+{
+	struct log_ring *lg, *next;
+	struct log_rec r;
+	unsigned int drops;
+	int dead;
+
+	for (lg = TAILQ_FIRST(&log_rings); lg != NULL; lg = next) {
+		next = TAILQ_NEXT(lg, entry);
+		/* Seen dead, all it has put is there to get. */
+		dead = __atomic_load_n(&lg->dead, __ATOMIC_ACQUIRE);
+		while (ring_get(&lg->ring, &r, sizeof(r)) > 0)
+			log_emit(&r);
+		drops = __atomic_load_n(&lg->drops, __ATOMIC_RELAXED);
+		if (drops != lg->dseen) {
+			r.fmt = "log: %u messages dropped";
+			r.pri = LOG_WARNING;
+			r.error = -1;
+			r.nargs = r.slen = 0;
+			log_arg_int(&r, drops - lg->dseen);
+			log_emit(&r);
+			lg->dseen = drops;
+		}
+		if (dead) {
+			TAILQ_REMOVE(&log_rings, lg, entry);
+			ring_destroy(&lg->ring);
+			free(lg);
+		}
+	}
+}
+
+static void
+log_exit(void *v)
+{
+	struct log_ring *lg = v;
+
+	__atomic_store_n(&lg->dead, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Only the forking thread lives on in the child, without the log
+ * thread.  What is queued was the parent's to write; the child starts
+ * over with empty rings.
+ */
+static void
+log_prefork(void)
+{
+	pthread_mutex_lock(&log_mtx);
+}
+
+static void
+log_postfork(void)
+{
+	pthread_mutex_unlock(&log_mtx);
+}
+
+static void
+log_child(void)
+{
+	struct log_ring *lg;
+
+	while ((lg = TAILQ_FIRST(&log_rings)) != NULL) {
+		TAILQ_REMOVE(&log_rings, lg, entry);
+		ring_destroy(&lg->ring);
+		free(lg);
+	}
+	pthread_setspecific(log_key, NULL);
+	log_self = NULL;
+	log_running = 0;
+	pthread_mutex_unlock(&log_mtx);
+}
+
+static void
+log_emit(struct log_rec *r)
+{
+	char line[LOG_LINEMAX];
+	size_t len;
+
+	log_format(r, line, sizeof(line));
+	if (r->error != -1) {
+		len = strlen(line);
+		snprintf(line + len, sizeof(line) - len, ": %s",
+		    strerror(r->error));
+	}
+	log_out(r->pri, line);
+}
+
+/*
+ * Format r into line, one conversion at a time with its own argument.
+ */
+static void
+log_format(struct log_rec *r, char *line, size_t size)
+{
+	const char *f = r->fmt;
+	char spec[64], conv;
+	size_t len = 0, n;
+	int a = 0, w;
+
+	while (*f != '\0' && len < size - 1) {
+		if (*f != '%') {
+			line[len++] = *f++;
+			continue;
+		}
+		n = strspn(f + 1, "#0- +'123456789.*hlLjzt") + 2;
+		if ((conv = f[n - 1]) == '\0' || n >= sizeof(spec))
+			break;
+		memcpy(spec, f, n);
+		spec[n] = '\0';
+		f += n;
+		if (conv == '%') {
+			line[len++] = '%';
+			continue;
+		}
+		if (log_star(r, &a, spec, sizeof(spec)) == -1)
+			w = snprintf(line + len, size - len, "?");
+		else
+			w = log_conv(r, a++, spec, conv, line + len,
+			    size - len);
+		if (w < 0)
+			break;
+		len += MIN((size_t)w, size - 1 - len);
+	}
+	line[len] = '\0';
+}
+
+/*
+ * Put the int arguments taken by a * width or precision of spec, from
+ * *a on, in its place, as printf(3) would take them.  A negative
+ * precision is as none.  Returns -1 if one is missing or not an int.
+ */
+static int
+log_star(struct log_rec *r, int *a, char *spec, size_t size)
+{
+	char num[16], *s;
+	size_t len = strlen(spec), k, n;
+	int v;
+
+	for (s = strchr(spec, '*'); s != NULL; s = strchr(s, '*')) {
+		if (*a >= r->nargs || r->kind[*a] != LOG_A_INT)
+			return -1;
+		v = (int)r->arg[(*a)++].i;
+		if (v < 0 && s > spec && s[-1] == '.') {
+			s--;
+			k = 0;
+		} else
+			k = snprintf(num, sizeof(num), "%d", v);
+		/* Replace the * or .* starting at s with num. */
+		n = (*s == '.') ? 2 : 1;
+		if (len - n + k >= size)
+			return -1;
+		memmove(s + k, s + n, len - (s - spec) - n + 1);
+		memcpy(s, num, k);
+		len = len - n + k;
+		s += k;
+	}
+	return 0;
+}
+
+/*
+ * Print argument a with conversion spec.  Integers are cast back as
+ * the length modifier says; an argument of the wrong kind for its
+ * conversion, or a missing one, comes out as "?".
+ */
+static int
+log_conv(struct log_rec *r, int a, const char *spec, char conv, char *buf,
+    size_t size)
+{
+	const char *lm = spec + strcspn(spec, "hlLjzt");
+	int sign = (conv == 'd' || conv == 'i');
+	u_int64_t v;
+
+	if (a >= r->nargs)
+		return snprintf(buf, size, "?");
+	switch (r->kind[a]) {
+	case LOG_A_STR:
+		if (conv == 's')
+			return snprintf(buf, size, spec,
+			    r->str + r->arg[a].i);
+		break;
+	case LOG_A_PTR:
+		if (conv == 'p')
+			return snprintf(buf, size, spec, r->arg[a].p);
+		if (conv == 's' && r->arg[a].p == NULL)
+			return snprintf(buf, size, "(null)");
+		break;
+	case LOG_A_DBL:
+		if (strchr("aAeEfFgG", conv) == NULL)
+			break;
+		if (*lm == 'L')
+			return snprintf(buf, size, spec,
+			    (long double)r->arg[a].d);
+		return snprintf(buf, size, spec, r->arg[a].d);
+	case LOG_A_INT:
+		if (strchr("diouxXc", conv) == NULL)
+			break;
+		v = r->arg[a].i;
+		if ((lm[0] == 'l' && lm[1] == 'l') || lm[0] == 'j')
+			return sign ? snprintf(buf, size, spec, (long long)v) :
+			    snprintf(buf, size, spec, (unsigned long long)v);
+		if (lm[0] == 'l' || lm[0] == 'z' || lm[0] == 't')
+			return sign ? snprintf(buf, size, spec, (long)v) :
+			    snprintf(buf, size, spec, (unsigned long)v);
+		return sign ? snprintf(buf, size, spec, (int)v) :
+		    snprintf(buf, size, spec, (unsigned int)v);
+	}
+	return snprintf(buf, size, "?");
+}
+
+static void
+log_out(int pri, const char *line)
+{
+	const char *pfx = (pri == LOG_CRIT) ? "fatal: " : "";
+
+	if (log_tostderr)
+		fprintf(stderr, "%s%s\n", pfx, line);
+	else
+		syslog(pri, "%s%s", pfx, line);
+}
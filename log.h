@@ -1,9 +1,173 @@
-#define	log_init(...)		do {} while (0)
-#define	log_verbose(...)	do {} while (0)
-#define	log_warn(...)		do {} while (0)
-#define	log_warnx(...)		do {} while (0)
-#define	log_debug(...)		do {} while (0)
-#define	log_info(...)		do {} while (0)
-
-#define	fatal(...)		do {} while (0)
-#define	fatalx(...)		do {} while (0)
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ICTRL_LOG_H_
+#define _ICTRL_LOG_H_
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+
+#define	LOG_MAXARGS		8
+#define	LOG_STRMAX		256	/* string argument bytes per call */
+
+/*
+ * A log call is recorded, not formatted: the format, errno and the
+ * arguments as they are go into a ring of the calling thread, and the
+ * log thread formats them later.  Argument types are taken with
+ * _Generic; strings are copied, as they may be gone by then.  Formats
+ * must therefore be static, e.g. string literals.  A * width or
+ * precision takes an int argument, as with printf(3).
+ */
+struct log_rec {
+	const char		*fmt;
+	int			 pri;
+	int			 error;	/* errno to append; -1 for none */
+	u_int16_t		 nargs;
+	u_int16_t		 slen;
+	char			 kind[LOG_MAXARGS];
+#define	LOG_A_INT		1
+#define	LOG_A_DBL		2
+#define	LOG_A_STR		3	/* i is the offset into str */
+#define	LOG_A_PTR		4
+	union {
+		u_int64_t	 i;
+		double		 d;
+		const void	*p;
+	}			 arg[LOG_MAXARGS];
+	char			 str[LOG_STRMAX];
+};
+
+extern int	log_verbosity;
+
+void		log_init(int);
+void		log_verbose(int);
+void		log_put(struct log_rec *);
+void		log_flush(void);
+__dead void	log_fatal(struct log_rec *);
+
+static inline void
+log_arg_int(struct log_rec *r, u_int64_t v)
+{
+	r->kind[r->nargs] = LOG_A_INT;
+	r->arg[r->nargs++].i = v;
+}
+
+static inline void
+log_arg_dbl(struct log_rec *r, double v)
+{
+	r->kind[r->nargs] = LOG_A_DBL;
+	r->arg[r->nargs++].d = v;
+}
+
+static inline void
+log_arg_ptr(struct log_rec *r, const void *v)
+{
+	r->kind[r->nargs] = LOG_A_PTR;
+	r->arg[r->nargs++].p = v;
+}
+
+/* Strings past LOG_STRMAX are cut short. */
+static inline void
+log_arg_str(struct log_rec *r, const char *s)
+{
+	size_t n;
+
+	if (s == NULL)
+		s = "(null)";
+	r->kind[r->nargs] = LOG_A_STR;
+	if (r->slen == LOG_STRMAX) {
+		/* Out of room; the last string's NUL makes it empty. */
+		r->arg[r->nargs++].i = LOG_STRMAX - 1;
+		return;
+	}
+	r->arg[r->nargs++].i = r->slen;
+	n = strlcpy(r->str + r->slen, s, LOG_STRMAX - r->slen);
+	if (n >= LOG_STRMAX - r->slen)
+		n = LOG_STRMAX - r->slen - 1;
+	r->slen += n + 1;
+}
+
+#define	LOG_ARG(r, x)	_Generic((x) + 0,				\
+	char *: log_arg_str,						\
+	const char *: log_arg_str,					\
+	float: log_arg_dbl,						\
+	double: log_arg_dbl,						\
+	long double: log_arg_dbl,					\
+	int: log_arg_int,						\
+	unsigned int: log_arg_int,					\
+	long: log_arg_int,						\
+	unsigned long: log_arg_int,					\
+	long long: log_arg_int,						\
+	unsigned long long: log_arg_int,				\
+	default: log_arg_ptr)((r), (x))
+
+#define	LOG_CAT(a, b)		LOG_CAT_(a, b)
+#define	LOG_CAT_(a, b)		a##b
+#define	LOG_NARGS(x...)		LOG_NARGS_(x, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define	LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...)	n
+
+#define	LOG_ARGS(r, x...)	LOG_CAT(LOG_ARGS_, LOG_NARGS(_, ##x))(r, ##x)
+#define	LOG_ARGS_0(r)
+#define	LOG_ARGS_1(r, a)	LOG_ARG(r, a)
+#define	LOG_ARGS_2(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_1(r, x)
+#define	LOG_ARGS_3(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_2(r, x)
+#define	LOG_ARGS_4(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_3(r, x)
+#define	LOG_ARGS_5(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_4(r, x)
+#define	LOG_ARGS_6(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_5(r, x)
+#define	LOG_ARGS_7(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_6(r, x)
+#define	LOG_ARGS_8(r, a, x...)	LOG_ARG(r, a); LOG_ARGS_7(r, x)
+
+#define	LOG_REC(lr, p, e, f, x...) do {					\
+	(lr)->error = (e);						\
+	(lr)->fmt = (f);						\
+	(lr)->pri = (p);						\
+	(lr)->nargs = 0;						\
+	(lr)->slen = 0;							\
+	LOG_ARGS(lr, ##x);						\
+} while (0)
+
+#define	LOG_CALL(p, e, f, x...) do {					\
+	struct log_rec _lr;						\
+									\
+	LOG_REC(&_lr, p, e, f, ##x);					\
+	log_put(&_lr);							\
+} while (0)
+
+#define	log_warn(f, x...)	LOG_CALL(LOG_ERR, errno, f, ##x)
+#define	log_warnx(f, x...)	LOG_CALL(LOG_ERR, -1, f, ##x)
+#define	log_info(f, x...)	LOG_CALL(LOG_INFO, -1, f, ##x)
+#define	log_debug(f, x...) do {						\
+	if (log_verbosity > 0)						\
+		LOG_CALL(LOG_DEBUG, -1, f, ##x);			\
+} while (0)
+
+#define	fatal(f, x...) do {						\
+	struct log_rec _lr;						\
+									\
+	LOG_REC(&_lr, LOG_CRIT, errno, f, ##x);				\
+	log_fatal(&_lr);						\
+} while (0)
+#define	fatalx(f, x...) do {						\
+	struct log_rec _lr;						\
+									\
+	LOG_REC(&_lr, LOG_CRIT, -1, f, ##x);				\
+	log_fatal(&_lr);						\
+} while (0)
+
+#endif /* _ICTRL_LOG_H_ */
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "ring.h"
+
+#define RING_REC(len)	(((len) + sizeof(u_int32_t) + 7) & ~(u_int32_t)7)
+
+static int	ring_check(size_t);
+static void	ring_setup(struct ring_end *, size_t, int);
+static u_int32_t ring_room(struct ring *);
+
+static int
+ring_check(size_t size)
+{
+	if (size < RING_MINSIZE || size > RING_MAXSIZE ||
+	    (size & (size - 1)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Lay the two rings out in the mapping.  The creator sends on the first
+ * one; the side attaching to it (peer != 0) on the second.
+ */
+static void
+ring_setup(struct ring_end *r, size_t size, int peer)
+{
+	char *a = r->map, *b = a + RING_HDRSIZE + size;
+	struct ring *first = peer ? &r->rx : &r->tx;
+	struct ring *second = peer ? &r->tx : &r->rx;
+
+	first->hdr = (struct ring_hdr *)a;
+	first->data = a + RING_HDRSIZE;
+	first->size = size;
+	first->pos = 0;
+	second->hdr = (struct ring_hdr *)b;
+	second->data = b + RING_HDRSIZE;
+	second->size = size;
+	second->pos = 0;
+}
+
+/*
+ * Create a pair of rings of size bytes each, and the doorbells.  The
+ * memory object goes to *fdp, to be passed to the peer along with both
+ * doorbells; it can be closed after.
+ */
+int
+ring_create(struct ring_end *r, size_t size, int *fdp)
+{
+#ifdef __linux__
+	int fd;
+
+	bzero(r, sizeof(*r));
+	r->efd = r->peer = -1;
+	if (ring_check(size) == -1)
+		return -1;
+	r->maplen = 2 * (RING_HDRSIZE + size);
+	if ((r->map = cbuf_memcreate(r->maplen, &fd)) == NULL)
+		return -1;
+#ifdef F_ADD_SEALS
+	/* Neither side may shrink the mapping under the other. */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_SEAL) == -1)
+		goto fail;
+#endif
+	if ((r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 ||
+	    (r->peer = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		goto fail;
+	ring_setup(r, size, 0);
+	*fdp = fd;
+	return 0;
+
+fail:
+	close(fd);
+	ring_destroy(r);
+	return -1;
+#else
+	/* No eventfd(2); the caller stays on the socket. */
+	bzero(r, sizeof(*r));
+	r->efd = r->peer = -1;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/*
+ * Map the rings created by the peer from memory object fd.  Takes over
+ * all three descriptors, also on failure.
+ */
+int
+ring_attach(struct ring_end *r, int fd, int efd, int peer, size_t size)
+{
+	struct stat st;
+	void *map;
+#ifdef F_GET_SEALS
+	int seals;
+#endif
+
+	bzero(r, sizeof(*r));
+	r->efd = efd;
+	r->peer = peer;
+	if (ring_check(size) == -1)
+		goto fail;
+	r->maplen = 2 * (RING_HDRSIZE + size);
+#ifdef F_GET_SEALS
+	if ((seals = fcntl(fd, F_GET_SEALS)) == -1 ||
+	    (seals & F_SEAL_SHRINK) == 0) {
+		errno = EPERM;
+		goto fail;
+	}
+#endif
+	if (fstat(fd, &st) == -1)
+		goto fail;
+	if (st.st_size < (off_t)r->maplen) {
+		errno = EINVAL;
+		goto fail;
+	}
+	/* A full doorbell must not block us. */
+	if (fcntl(efd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(peer, F_SETFL, O_NONBLOCK) == -1)
+		goto fail;
+	map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	close(fd);
+	r->map = map;
+	ring_setup(r, size, 1);
+	return 0;
+
+fail:
+	close(fd);
+	ring_destroy(r);
+	return -1;
+}
+
+/*
+ * A ring between threads of this process, with no doorbells: one
+ * thread puts and another gets on the same end.
+ */
+int
+ring_local(struct ring_end *r, size_t size)
+{
+	void *map;
+
+	bzero(r, sizeof(*r));
+	r->efd = r->peer = -1;
+	if (ring_check(size) == -1)
+		return -1;
+	r->maplen = RING_HDRSIZE + size;
+	map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	r->map = map;
+	r->tx.hdr = r->rx.hdr = map;
+	r->tx.data = r->rx.data = (char *)map + RING_HDRSIZE;
+	r->tx.size = r->rx.size = size;
+	return 0;
+}
+
+void
+ring_destroy(struct ring_end *r)
+{
+	if (r->map != NULL)
+		munmap(r->map, r->maplen);
+	if (r->efd != -1)
+		close(r->efd);
+	if (r->peer != -1)
+		close(r->peer);
+	r->map = NULL;
+	r->efd = r->peer = -1;
+}
+
+/*
+ * Free bytes in ring t we produce on.  A tail that is off is taken as
+ * a full ring.
+ */
+static u_int32_t
+ring_room(struct ring *t)
+{
+	u_int32_t used;
+
+	used = t->pos - __atomic_load_n(&t->hdr->tail, __ATOMIC_SEQ_CST);
+	if (used > t->size)
+		return 0;
+	return t->size - used;
+}
+
+/*
+ * Copy a message from iovcnt iovs into the send ring.  Returns its
+ * length, or -1 if there is no room, with wwait set so that the peer
+ * rings us once it has made some.
+ */
+int
+ring_put(struct ring_end *r, struct iovec *iov, int iovcnt)
+{
+	struct ring *t = &r->tx;
+	u_int32_t len = 0, need, off, skip, wrap = RING_WRAP;
+	char *ptr;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	need = RING_REC(len);
+	if (len == 0 || need > t->size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	off = t->pos & (t->size - 1);
+	skip = (t->size - off < need) ? t->size - off : 0;
+	if (ring_room(t) < skip + need) {
+		__atomic_store_n(&t->hdr->wwait, 1, __ATOMIC_SEQ_CST);
+		if (ring_room(t) < skip + need) {
+			errno = EAGAIN;
+			return -1;
+		}
+		__atomic_store_n(&t->hdr->wwait, 0, __ATOMIC_RELAXED);
+	}
+
+	if (skip != 0) {
+		memcpy(t->data + off, &wrap, sizeof(wrap));
+		t->pos += skip;
+		off = 0;
+	}
+	ptr = t->data + off;
+	memcpy(ptr, &len, sizeof(len));
+	ptr += sizeof(len);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+	t->pos += need;
+	__atomic_store_n(&t->hdr->head, t->pos, __ATOMIC_RELEASE);
+	return len;
+}
+
+/*
+ * Copy the next message of the receive ring into buf.  The message is
+ * copied before it is looked at, since the peer can still write the
+ * ring.  Returns its length, 0 if the ring is empty, or -1 if the ring
+ * is corrupt or the message longer than len.
+ */
+ssize_t
+ring_get(struct ring_end *r, void *buf, size_t buflen)
+{
+	struct ring *t = &r->rx;
+	u_int32_t head, len, need, off;
+
+	for (;;) {
+		head = __atomic_load_n(&t->hdr->head, __ATOMIC_ACQUIRE);
+		if (head == t->pos)
+			return 0;
+		if (head - t->pos > t->size)
+			return -1;
+		off = t->pos & (t->size - 1);
+		memcpy(&len, t->data + off, sizeof(len));
+		if (len != RING_WRAP)
+			break;
+		if (head - t->pos < t->size - off)
+			return -1;
+		t->pos += t->size - off;
+	}
+	if (len == 0 || len > buflen || len > t->size)
+		return -1;
+	need = RING_REC(len);
+	if (need > t->size - off || need > head - t->pos)
+		return -1;
+	memcpy(buf, t->data + off + sizeof(len), len);
+	t->pos += need;
+	__atomic_store_n(&t->hdr->tail, t->pos, __ATOMIC_RELEASE);
+	return len;
+}
+
+int
+ring_ready(struct ring_end *r)
+{
+	return __atomic_load_n(&r->rx.hdr->head, __ATOMIC_ACQUIRE) !=
+	    r->rx.pos;
+}
+
+/*
+ * Ring the peer if it sleeps on messages we have put, or waits for room
+ * we have made.  Called once after a run of ring_put() or ring_get().
+ */
+void
+ring_notify(struct ring_end *r)
+{
+	int kick = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->tx.hdr->rwait, __ATOMIC_RELAXED) &&
+	    __atomic_load_n(&r->tx.hdr->tail, __ATOMIC_RELAXED) !=
+	    r->tx.pos &&
+	    __atomic_exchange_n(&r->tx.hdr->rwait, 0, __ATOMIC_RELAXED))
+		kick = 1;
+	if (__atomic_load_n(&r->rx.hdr->wwait, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&r->rx.hdr->wwait, 0, __ATOMIC_RELAXED))
+		kick = 1;
+	if (kick)
+		ring_kick(r->peer);
+}
+
+/*
+ * About to wait for the doorbell: have the peer ring it for the next
+ * message.  Returns 1 if one came in meanwhile and there is no need to.
+ */
+int
+ring_sleep(struct ring_end *r)
+{
+	__atomic_store_n(&r->rx.hdr->rwait, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->rx.hdr->head, __ATOMIC_SEQ_CST) == r->rx.pos)
+		return 0;
+	__atomic_store_n(&r->rx.hdr->rwait, 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Reset our doorbell after a wakeup.
+ */
+void
+ring_wake(struct ring_end *r)
+{
+	u_int64_t n;
+
+	(void)read(r->efd, &n, sizeof(n));
+}
+
+void
+ring_kick(int fd)
+{
+	u_int64_t n = 1;
+
+	(void)write(fd, &n, sizeof(n));
+}
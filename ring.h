@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ICTRL_RING_H_
+#define _ICTRL_RING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RING_MINSIZE		(64 * 1024)
+#define RING_MAXSIZE		(64 * 1024 * 1024)
+#define RING_HDRSIZE		256
+
+/*
+ * Single-producer single-consumer message ring in shared memory.  The
+ * producer owns head and the consumer tail; both are free-running byte
+ * counters.  A record is a u_int32_t length and the message, padded to
+ * 8 bytes; records do not wrap, a RING_WRAP length skips to the start.
+ * rwait is set by a consumer about to sleep, wwait by a producer out of
+ * room; the other side rings the doorbell when it sees them.
+ */
+struct ring_hdr {
+	u_int32_t		 head;
+	char			 pad0[60];
+	u_int32_t		 tail;
+	char			 pad1[60];
+	u_int32_t		 rwait;
+	u_int32_t		 wwait;
+};
+
+#define RING_WRAP		0xffffffffU
+
+/*
+ * One direction.  Our own position is kept here and only written out;
+ * the peer's is read from the shared header and checked, as the peer
+ * may be hostile.
+ */
+struct ring {
+	struct ring_hdr		*hdr;
+	char			*data;
+	u_int32_t		 size;
+	u_int32_t		 pos;	/* our head or tail */
+};
+
+/*
+ * Our end of a ring pair: the mapping of both rings, and the doorbells,
+ * eventfds counting wakeups.  We wait on efd and ring peer.
+ */
+struct ring_end {
+	void			*map;
+	size_t			 maplen;
+	struct ring		 tx;
+	struct ring		 rx;
+	int			 efd;
+	int			 peer;
+};
+
+int	ring_create(struct ring_end *, size_t, int *);
+int	ring_attach(struct ring_end *, int, int, int, size_t);
+int	ring_local(struct ring_end *, size_t);
+void	ring_destroy(struct ring_end *);
+int	ring_put(struct ring_end *, struct iovec *, int);
+ssize_t	ring_get(struct ring_end *, void *, size_t);
+int	ring_ready(struct ring_end *);
+void	ring_notify(struct ring_end *);
+int	ring_sleep(struct ring_end *);
+void	ring_wake(struct ring_end *);
+void	ring_kick(int);
+
+#endif /* _ICTRL_RING_H_ */
@@ -0,0 +1,453 @@
+#!/usr/bin/awk -f
+#
+# Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Compile a message schema into a header of typed build and parse
+# functions, for C and C++:
+#
+#	awk -f schema.awk foo.msg > foo_msg.h
+#
+# A schema names a prefix, then the messages and their fields:
+#
+#	prefix	foo
+#	message	hello	1
+#		u32	flags
+#		string	name
+#		bytes	blob
+#	end
+#
+# Fields are u8, u16, u32, u64, i8, i16, i32, i64, string (NUL
+# terminated) and bytes.  For each message, struct foo_hello holds the
+# fields, strings and bytes as pointers, bytes with a length blob_len.
+# foo_hello_build() builds one in place in the message block with
+# ictrl_reserve(); foo_hello_parse() checks one in a single pass and
+# fills in a struct foo_hello pointing into it.  FOO_HELLO_HANDLER(fn)
+# initializes a struct ictrl_handler with its limits.
+#
+# A message is one part: struct foo_hello_wire, with the scalars and the
+# lengths of the others, then the strings and bytes in order, each
+# aligned to CBUF_ALIGN.  Being local, it is in host byte order.
+#
+
+function fail(msg) {
+	printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+	errors++
+}
+
+function ident(s) {
+	return s ~ /^[A-Za-z_][A-Za-z0-9_]*$/
+}
+
+function number(s,	i, c, v) {
+	if (s ~ /^[0-9]+$/)
+		return s + 0
+	if (s !~ /^0[xX][0-9A-Fa-f]+$/)
+		return -1
+	v = 0
+	for (i = 3; i <= length(s); i++) {
+		c = index("0123456789abcdef", tolower(substr(s, i, 1)))
+		v = v * 16 + c - 1
+	}
+	return v
+}
+
+# A line of output, given in one or two pieces.
+function emit(s, s2) {
+	out = out s s2 "\n"
+}
+
+function preamble(	guard) {
+	guard = "_" toupper(prefix) "_MSG_H_"
+	emit("/* Generated by schema.awk from " FILENAME "; do not edit. */")
+	emit("")
+	emit("#ifndef " guard)
+	emit("#define " guard)
+	emit("")
+	emit("#include <sys/types.h>")
+	emit("")
+	emit("#include <errno.h>")
+	emit("#include <stdint.h>")
+	emit("#include <string.h>")
+	emit("")
+	emit("#include \"buf.h\"")
+	emit("#include \"ictrl.h\"")
+	emit("")
+	emit("#ifdef __cplusplus")
+	emit("extern \"C\" {")
+	emit("#endif")
+	emit("")
+	emit("/*")
+	emit(" * Put a field of len bytes at *p, zero its padding and step",
+	    " past it.")
+	emit(" */")
+	emit("static inline void")
+	emit(prefix "_msg_put(char **p, const void *src, size_t len)")
+	emit("{")
+	emit("\tif (len > 0)")
+	emit("\t\tmemcpy(*p, src, len);")
+	emit("\tmemset(*p + len, 0, CBUF_LEN(len) - len);")
+	emit("\t*p += CBUF_LEN(len);")
+	emit("}")
+	emit("")
+	emit("/*")
+	emit(" * Take a field of len bytes at *off of a part of size bytes",
+	    " and step")
+	emit(" * past it; NULL if it does not fit.")
+	emit(" */")
+	emit("static inline const char *")
+	emit(head(prefix "_msg_get",
+	    "const char *base, size_t size, size_t *off", "size_t len"))
+	emit("{")
+	emit("\tconst char *p = base + *off;")
+	emit("")
+	emit("\tif (*off > size || len > size - *off)")
+	emit("\t\treturn NULL;")
+	emit("\t*off += CBUF_LEN(len);")
+	emit("\treturn p;")
+	emit("}")
+}
+
+function ctype(t) {
+	if (t ~ /^u/)
+		return "u_int" substr(t, 2) "_t"
+	return "int" substr(t, 2) "_t"
+}
+
+# Tabs to column col, from a line of n characters.
+function tabto(n, col,	s) {
+	s = ""
+	do {
+		s = s "\t"
+		n = n - n % 8 + 8
+	} while (n < col)
+	return s
+}
+
+function member(type, name, comment,	s) {
+	s = "\t" type tabto(8 + length(type), 32) name ";"
+	if (comment != "")
+		s = s tabto(32 + length(name) + 1, 48) "/* " comment " */"
+	return s
+}
+
+function define(name, value) {
+	return "#define\t" name tabto(8 + length(name), 32) value
+}
+
+# A line of width n continued with a backslash in column 72.
+function cont(s, n) {
+	return s tabto(n, 72) "\\"
+}
+
+# A function head, cut after its first argument if too long.
+function head(name, a1, a2) {
+	if (length(name) + length(a1) + length(a2) + 4 <= 80)
+		return name "(" a1 ", " a2 ")"
+	return name "(" a1 ",\n    " a2 ")"
+}
+
+function message(	i, t, n, full, up, ty, nvar) {
+	full = prefix "_" mname
+	up = toupper(full)
+	ty = toupper(prefix) "_T_" toupper(mname)
+	nvar = 0
+	for (i = 1; i <= nf; i++)
+		if (ftype[i] == "string" || ftype[i] == "bytes")
+			nvar++
+
+	emit("")
+	emit(define(ty, mtype))
+
+	if (nf == 0) {
+		emit(define(up "_HANDLER(fn)", "{ (fn), 0, 0, 0, 0 }"))
+		emit("")
+		emit("static inline int")
+		emit(full "_build(struct ictrl_session *c)")
+		emit("{")
+		emit("\treturn ictrl_buildv(c, " ty ", 0, NULL);")
+		emit("}")
+		emit("")
+		emit("static inline int")
+		emit(full "_parse(struct cbuf *cbuf)")
+		emit("{")
+		emit("\tif (((struct cbuf_msghdr *)",
+		    "cbuf_getbuf(cbuf, NULL, 0))->type !=")
+		emit("\t    " ty " || cbuf->iovlen != 1) {")
+		emit("\t\terrno = EINVAL;")
+		emit("\t\treturn -1;")
+		emit("\t}")
+		emit("\treturn 0;")
+		emit("}")
+		return
+	}
+
+	emit(cont("#define\t" up "_HANDLER(fn)", 8 + length(up "_HANDLER(fn)")))
+	if (nvar > 0)
+		emit("\t{ (fn), 1, 1, sizeof(struct " full "_wire), 0 }")
+	else {
+		n = "{ (fn), 1, 1, sizeof(struct " full "_wire),"
+		emit(cont("\t" n, 8 + length(n)))
+		emit("\t    sizeof(struct " full "_wire) }")
+	}
+
+	emit("")
+	emit("struct " full " {")
+	for (i = 1; i <= nf; i++) {
+		t = ftype[i]
+		n = fname[i]
+		if (t == "string")
+			emit(member("const char", "*" n, "NULL for none"))
+		else if (t == "bytes") {
+			emit(member("const void", "*" n))
+			emit(member("size_t", " " n "_len"))
+		} else
+			emit(member(ctype(t), " " n))
+	}
+	emit("};")
+
+	emit("")
+	emit("struct " full "_wire {")
+	for (i = 1; i <= nf; i++) {
+		t = ftype[i]
+		if (t == "string" || t == "bytes")
+			emit(member("u_int32_t", " " fname[i] "_len"))
+		else
+			emit(member(ctype(t), " " fname[i]))
+	}
+	emit("} __packed __aligned(CBUF_ALIGN);")
+
+	# build
+	emit("")
+	emit("static inline int")
+	emit(head(full "_build", "struct ictrl_session *c",
+	    "const struct " full " *m"))
+	emit("{")
+	emit("\tstruct " full "_wire *w;")
+	emit("\tstruct cbuf *cbuf;")
+	emit("\tstruct iovec iov;")
+	for (i = 1; i <= nf; i++) {
+		if (ftype[i] != "string")
+			continue
+		n = fname[i]
+		emit("\tsize_t " n "_len = (m->" n " != NULL) ?")
+		emit("\t    strlen(m->" n ") + 1 : 0;")
+	}
+	if (nvar > 0)
+		emit("\tchar *p;")
+	emit("\tint error;")
+	emit("")
+	for (i = 1; i <= nf; i++) {
+		if (ftype[i] == "string")
+			emit("\tif (" fname[i] "_len > UINT32_MAX) {")
+		else if (ftype[i] == "bytes")
+			emit("\tif (m->" fname[i] "_len > UINT32_MAX) {")
+		else
+			continue
+		emit("\t\terrno = EMSGSIZE;")
+		emit("\t\treturn -1;")
+		emit("\t}")
+	}
+	emit("\tiov.iov_base = NULL;")
+	emit("\tiov.iov_len = CBUF_LEN(sizeof(*w));")
+	for (i = 1; i <= nf; i++) {
+		if (ftype[i] == "string")
+			emit("\tiov.iov_len += CBUF_LEN(" fname[i] "_len);")
+		else if (ftype[i] == "bytes")
+			emit("\tiov.iov_len += CBUF_LEN(m->" fname[i] "_len);")
+	}
+	emit("\tif ((error = ictrl_reserve(c, " ty ", 1, &iov,")
+	emit("\t    &cbuf)) != 0)")
+	emit("\t\treturn error;")
+	emit("")
+	emit("\tw = (struct " full "_wire *)cbuf_getbuf(cbuf, NULL, 1);")
+	for (i = 1; i <= nf; i++) {
+		if (ftype[i] == "string")
+			emit("\tw->" fname[i] "_len = " fname[i] "_len;")
+		else if (ftype[i] == "bytes")
+			emit("\tw->" fname[i] "_len = m->" fname[i] "_len;")
+		else
+			emit("\tw->" fname[i] " = m->" fname[i] ";")
+	}
+	emit("\tmemset((char *)w + sizeof(*w), 0, ",
+	    "CBUF_LEN(sizeof(*w)) - sizeof(*w));")
+	if (nvar > 0) {
+		emit("\tp = (char *)w + CBUF_LEN(sizeof(*w));")
+		emit("")
+	}
+	for (i = 1; i <= nf; i++) {
+		n = fname[i]
+		if (ftype[i] == "string")
+			emit("\t" prefix "_msg_put(&p, m->" n ", " n "_len);")
+		else if (ftype[i] == "bytes")
+			emit("\t" prefix "_msg_put(&p, m->" n ", ",
+			    "m->" n "_len);")
+	}
+	emit("\treturn ictrl_commit(c, cbuf);")
+	emit("}")
+
+	# parse
+	emit("")
+	emit("static inline int")
+	emit(head(full "_parse", "struct cbuf *cbuf", "struct " full " *m"))
+	emit("{")
+	emit("\tconst struct " full "_wire *w;")
+	if (nvar > 0) {
+		emit("\tconst char *base, *p;")
+		emit("\tsize_t len, off;")
+	} else {
+		emit("\tconst char *base;")
+		emit("\tsize_t len;")
+	}
+	emit("")
+	emit("\tif (((struct cbuf_msghdr *)",
+	    "cbuf_getbuf(cbuf, NULL, 0))->type !=")
+	emit("\t    " ty " || cbuf->iovlen != 2 ||")
+	emit("\t    (cbuf->flags & CBUF_F_FRAG) ||")
+	emit("\t    (base = (const char *)",
+	    "cbuf_getbuf(cbuf, &len, 1)) == NULL ||")
+	emit("\t    len < sizeof(*w))")
+	emit("\t\tgoto bad;")
+	emit("\tw = (const struct " full "_wire *)base;")
+	if (nvar > 0)
+		emit("\toff = CBUF_LEN(sizeof(*w));")
+	for (i = 1; i <= nf; i++) {
+		t = ftype[i]
+		n = fname[i]
+		if (t == "string") {
+			emit("\tif ((p = " prefix "_msg_get(base, len, &off, ",
+			    "w->" n "_len)) == NULL ||")
+			emit("\t    (w->" n "_len > 0 && ",
+			    "p[w->" n "_len - 1] != '\\0'))")
+			emit("\t\tgoto bad;")
+			emit("\tm->" n " = (w->" n "_len > 0) ? p : NULL;")
+		} else if (t == "bytes") {
+			emit("\tif ((p = " prefix "_msg_get(base, len, &off, ",
+			    "w->" n "_len)) == NULL)")
+			emit("\t\tgoto bad;")
+			emit("\tm->" n " = p;")
+			emit("\tm->" n "_len = w->" n "_len;")
+		} else
+			emit("\tm->" n " = w->" n ";")
+	}
+	emit("\treturn 0;")
+	emit(" bad:")
+	emit("\terrno = EINVAL;")
+	emit("\treturn -1;")
+	emit("}")
+}
+
+BEGIN {
+	scalar["u8"] = scalar["u16"] = scalar["u32"] = scalar["u64"] = 1
+	scalar["i8"] = scalar["i16"] = scalar["i32"] = scalar["i64"] = 1
+	reserved = 7936		# ICTRL_T_RESERVED
+}
+
+{
+	sub(/#.*/, "")
+}
+
+NF == 0 {
+	next
+}
+
+$1 == "prefix" {
+	if (NF != 2 || !ident($2))
+		fail("usage: prefix name")
+	else if (prefix != "")
+		fail("prefix given twice")
+	else {
+		prefix = $2
+		preamble()
+	}
+	next
+}
+
+$1 == "message" {
+	if (prefix == "")
+		fail("message before prefix")
+	else if (inmsg)
+		fail("message " mname " has no end")
+	if (NF != 3 || !ident($2)) {
+		fail("usage: message name type")
+		next
+	}
+	mname = $2
+	mtype = number($3)
+	if (mtype < 0 || mtype >= reserved)
+		fail("message " mname ": type " $3 " not below " reserved)
+	else if (mtype in types)
+		fail("message " mname ": type " $3 " is also " types[mtype])
+	if (mname in names)
+		fail("message " mname " given twice")
+	types[mtype] = names[mname] = mname
+	inmsg = 1
+	nf = 0
+	for (i in seen)
+		delete seen[i]
+	next
+}
+
+$1 == "end" {
+	if (!inmsg)
+		fail("end without message")
+	else if (prefix != "")
+		message()
+	inmsg = 0
+	next
+}
+
+{
+	if (!inmsg) {
+		fail("field outside of a message")
+		next
+	}
+	if (NF != 2 || !ident($2)) {
+		fail("usage: type name")
+		next
+	}
+	if (!($1 in scalar) && $1 != "string" && $1 != "bytes") {
+		fail("unknown type " $1)
+		next
+	}
+	# Strings and bytes take name_len as well.
+	if (($2 in seen) || ($1 !~ /^[ui]/ && ($2 "_len") in seen)) {
+		fail("field " $2 " clashes in message " mname)
+		next
+	}
+	seen[$2] = 1
+	if (!($1 in scalar))
+		seen[$2 "_len"] = 1
+	nf++
+	ftype[nf] = $1
+	fname[nf] = $2
+}
+
+END {
+	if (inmsg)
+		fail("message " mname " has no end")
+	if (prefix == "")
+		fail("no prefix")
+	if (errors > 0)
+		exit 1
+	emit("")
+	emit("#ifdef __cplusplus")
+	emit("}")
+	emit("#endif")
+	emit("")
+	emit("#endif /* _" toupper(prefix) "_MSG_H_ */")
+	printf("%s", out)
+}
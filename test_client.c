@@ -14,36 +14,48 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>	/* MIN */
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <err.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buf.h"
 #include "ictrl.h"
+#include "test_msg.h"
+
+/* Not in test.msg: one raw part of exactly TEST_THREE_LEN bytes. */
+#define TEST_T_THREE	3
+#define TEST_THREE_LEN	10
 
 struct ictrl_config config = {
 	.path = "/var/run/hoge.sock"
 };
 
+int	request(struct ictrl_session *, int, char *);
+int	scale(int, int, char *);
+
 int
 main(int argc, char *argv[])
 {
 	struct ictrl_session *c;
-	char *strs[] = { "hoge", "fuga" };
+	char *strs[] = { "hoge", "fuga", "piyopiyo!" };
 	struct cbuf *cbuf;
 	struct cbuf_msghdr *cmh;
 	int id = 1;
+	int nsessions = 0;
 	int ch;
 
-	struct iovec iov[CBUF_MAXIOV] = {
-		[0] = {
-			.iov_base = "common",
-			.iov_len = 7
-		}
-	};
-
-	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "c:n:s:")) != -1) {
 		switch (ch) {
+		case 'c':
+			nsessions = atoi(optarg);
+			break;
 		case 'n':
 			id = atoi(optarg);
 			break;
@@ -54,14 +66,14 @@ main(int argc, char *argv[])
 	}
 
 	char *s = strs[id - 1];
-	iov[1].iov_base = s;
-	iov[1].iov_len = strlen(s) + 1;
+
+	if (nsessions > 0)
+		return scale(nsessions, id, s);
 
 	c = ictrl_client_init(&config);
 
 	// {
-	//ictrl_build(c, id, strs[id - 1], 5);
-	ictrl_buildv(c, id, 2, iov);
+	request(c, id, s);
 
 	ictrl_send(c);
 	cbuf = ictrl_recv(c);
@@ -71,10 +83,78 @@ main(int argc, char *argv[])
 	} else {
 		return 1;
 	}
-	cbuf_free(cbuf);
 	// }
 
 	ictrl_client_fini(c);
 
+	/* A reply outlives its session. */
+	cbuf_free(cbuf);
+
+	return 0;
+}
+
+int
+request(struct ictrl_session *c, int id, char *s)
+{
+	struct test_one one = { .common = "common", .str = s };
+	struct test_two two = { .common = "common", .str = s };
+
+	switch (id) {
+	case TEST_T_ONE:
+		return test_one_build(c, &one);
+	case TEST_T_TWO:
+		return test_two_build(c, &two);
+	default:
+		/* At the handler's maxlen, which is not a multiple of 4. */
+		return ictrl_build(c, TEST_T_THREE, s, TEST_THREE_LEN);
+	}
+}
+
+/*
+ * Open n sessions, one request each, and hold them all open; e.g. -c
+ * 10000 or -c 50000.  The server needs as many descriptors.  The maxrss
+ * printed is this process's; the server's must be read on its side.
+ */
+int
+scale(int n, int id, char *s)
+{
+	struct ictrl_session **cs;
+	struct cbuf *cbuf;
+	struct cbuf_msghdr *cmh;
+	struct timespec t0, t1;
+	struct rlimit rl;
+	struct rusage ru;
+	int i;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)n + 16) {
+		rl.rlim_cur = MIN(rl.rlim_max, (rlim_t)n + 16);
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if ((cs = calloc(n, sizeof(*cs))) == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		if ((cs[i] = ictrl_client_init(&config)) == NULL)
+			errx(1, "session %d", i);
+		request(cs[i], id, s);
+		if (ictrl_send(cs[i]) != 0 ||
+		    (cbuf = ictrl_recv(cs[i])) == NULL)
+			errx(1, "session %d: no reply", i);
+		cmh = cbuf_getbuf(cbuf, NULL, 0);
+		if (cmh->type != id * 10)
+			errx(1, "session %d: reply %d", i, cmh->type);
+		cbuf_free(cbuf);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%d sessions in %.3f s, client maxrss %ld KB\n", n,
+	    (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+	    ru.ru_maxrss);
+
+	for (i = 0; i < n; i++)
+		ictrl_client_fini(cs[i]);
+	free(cs);
 	return 0;
 }
@@ -25,6 +25,7 @@
 #include "buf.h"
 #include "ictrl.h"
 #include "server.h"
+#include "test_msg.h"
 
 struct test_context {
 	struct ictrl_config *ctrl_cf;
@@ -41,8 +42,20 @@ void test_server_start(void *);
 void test_server_stop(void *);
 void test_server_shutdown(void *);
 int test_shutdown_isdown(void *);
-void test_ictrl_proc(struct ictrl_session *, struct cbuf *);
-void test_ictrl_proc2(struct ictrl_session *, struct cbuf *);
+int test_ictrl_one(struct ictrl_session *, struct cbuf *);
+int test_ictrl_two(struct ictrl_session *, struct cbuf *);
+int test_ictrl_three(struct ictrl_session *, struct cbuf *);
+
+/* Not in test.msg: one raw part of exactly TEST_THREE_LEN bytes. */
+#define TEST_T_THREE	3
+#define TEST_THREE_LEN	10
+
+const struct ictrl_handler test_handler_one =
+    TEST_ONE_HANDLER(test_ictrl_one);
+const struct ictrl_handler test_handler_two =
+    TEST_TWO_HANDLER(test_ictrl_two);
+const struct ictrl_handler test_handler_three =
+    { test_ictrl_three, 1, 1, TEST_THREE_LEN, TEST_THREE_LEN };
 
 int
 main(int argc, char *argv[])
@@ -68,13 +81,11 @@ main(int argc, char *argv[])
 	};
 	struct ictrl_config ctrl_cf = {
 		.path = "/var/run/hoge.sock",
-		.backlog = 5,
-		.proc = test_ictrl_proc
+		.backlog = 5
 	};
 	struct ictrl_config ctrl_cf2 = {
 		.path = "/var/run/hoge2.sock",
-		.backlog = 5,
-		.proc = test_ictrl_proc2
+		.backlog = 5
 	};
 	struct test_context test = {
 		.ctrl_cf = &ctrl_cf,
@@ -136,6 +147,12 @@ test_server_init(void *data)
 
 	test->ctrl = ictrl_server_init(test->ctrl_cf);
 	test->ctrl2 = ictrl_server_init(test->ctrl_cf2);
+	if (test->ctrl == NULL || test->ctrl2 == NULL)
+		errx(1, "cannot listen");
+	if (ictrl_handle(test->ctrl, TEST_T_ONE, &test_handler_one) == -1 ||
+	    ictrl_handle(test->ctrl, TEST_T_THREE, &test_handler_three) == -1 ||
+	    ictrl_handle(test->ctrl2, TEST_T_TWO, &test_handler_two) == -1)
+		err(1, "ictrl_handle");
 }
 
 void
@@ -183,60 +200,38 @@ test_shutdown_isdown(void *data)
 	return 1;
 }
 
-void
-test_ictrl_proc(struct ictrl_session *c, struct cbuf *cbuf)
+int
+test_ictrl_one(struct ictrl_session *c, struct cbuf *cbuf)
 {
-	struct cbuf_msghdr *cmh;
-	char *str;
-	size_t len;
-
-	cmh = cbuf_getbuf(cbuf, NULL, 0);
-	if (cmh == NULL)
-		goto done;
-
-	switch (cmh->type) {
-	case 1:
-		printf("got 1!\n");
-		str = cbuf_getbuf(cbuf, &len, 1);
-		printf("str=%s\n", str);
-		str = cbuf_getbuf(cbuf, &len, 2);
-		printf("str=%s\n", str);
-
-		ictrl_build(c, 10, NULL, 0);
-		break;
-	default:
-		break;
-	}
+	struct test_one m;
+
+	if (test_one_parse(cbuf, &m) == -1)
+		return -1;
+	printf("got 1!\n");
+	printf("str=%s\n", m.common ? m.common : "");
+	printf("str=%s\n", m.str ? m.str : "");
 
-done:
-	cbuf_free(cbuf);
+	return test_one_ok_build(c);
 }
 
-void
-test_ictrl_proc2(struct ictrl_session *c, struct cbuf *cbuf)
+int
+test_ictrl_two(struct ictrl_session *c, struct cbuf *cbuf)
 {
-	struct cbuf_msghdr *cmh;
-	char *str;
-	size_t len;
-
-	cmh = cbuf_getbuf(cbuf, &len, 0);
-	if (cmh == NULL)
-		goto done;
-
-	switch (cmh->type) {
-	case 2:
-		printf("got 2!\n");
-		str = cbuf_getbuf(cbuf, &len, 1);
-		printf("str=%s\n", str);
-		str = cbuf_getbuf(cbuf, &len, 2);
-		printf("str=%s\n", str);
-
-		ictrl_build(c, 20, NULL, 0);
-		break;
-	default:
-		break;
-	}
+	struct test_two m;
+
+	if (test_two_parse(cbuf, &m) == -1)
+		return -1;
+	printf("got 2!\n");
+	printf("str=%s\n", m.common ? m.common : "");
+	printf("str=%s\n", m.str ? m.str : "");
+
+	return test_two_ok_build(c);
+}
+
+int
+test_ictrl_three(struct ictrl_session *c, struct cbuf *cbuf)
+{
+	printf("got 3!\n");
 
-done:
-	cbuf_free(cbuf);
+	return ictrl_buildv(c, TEST_T_THREE * 10, 0, NULL);
 }
@@ -3,9 +3,18 @@ SRCS=	test_server.c
 
 LDADD=	-L. -lictrl \
 	-levent \
+	-lpthread \
 	-lutil \
 
+CFLAGS+=	-I${.OBJDIR}
+CLEANFILES+=	test_msg.h
+
 NOMAN=	1
 NOLINT=	1
 
 .include <bsd.prog.mk>
+
+test_msg.h: test.msg schema.awk
+	awk -f ${.CURDIR}/schema.awk ${.CURDIR}/test.msg > ${.TARGET}
+
+test_server.o: test_msg.h
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>	/* MAX MIN */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+/*
+ * Multishot recvmsg came with Linux 6.0, which no feature bit tells;
+ * the first one after it does.
+ */
+#ifndef IORING_FEAT_REG_REG_RING
+#define	IORING_FEAT_REG_REG_RING	(1U << 13)
+#endif
+
+#define	URING_SQ		64	/* submission entries */
+#define	URING_CQ		4096	/* completion entries */
+#define	URING_BGID		0	/* provided buffer group */
+#define	URING_UD_FINI		(~(u_int64_t)0)
+
+/*
+ * The rings are shared with the kernel: we own the submission tail and
+ * the completion head, the kernel the other ends.  Submission array
+ * slots map one to one to entries.  Everything is submitted as soon as
+ * it is queued, so the submission ring is empty between calls.
+ */
+struct uring {
+	int			 fd;
+	int			 efd;	/* completions ring it */
+	struct msghdr		 msg;	/* receive template */
+	void			*sqmap;
+	size_t			 sqmaplen;
+	u_int32_t		*sqhead;
+	u_int32_t		*sqtail;
+	u_int32_t		*sqflags;
+	u_int32_t		 sqmask;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqeslen;
+	void			*cqmap;	/* may be sqmap */
+	size_t			 cqmaplen;
+	u_int32_t		*cqhead;
+	u_int32_t		*cqtail;
+	u_int32_t		 cqmask;
+	struct io_uring_cqe	*cqes;
+	struct io_uring_buf_ring *br;	/* NULL until registered */
+	size_t			 brlen;
+	u_int16_t		 brtail;
+	unsigned int		 nbufs;
+	size_t			 bufsize;
+	char			*bufs;
+	size_t			 bufslen;
+};
+
+static int	uring_enter(int, u_int32_t, u_int32_t, u_int32_t);
+static int	uring_register(int, u_int32_t, void *, u_int32_t);
+static void	*uring_map(int, size_t, off_t);
+static struct io_uring_sqe *
+		uring_sqe(struct uring *);
+static int	uring_submit(struct uring *);
+
+/*
+ * Set up a uring with nbufs receive buffers, a power of 2, each taking
+ * a datagram of size bytes and controllen bytes of control messages.
+ * Returns NULL with errno set if the kernel is without what we need.
+ */
+struct uring *
+uring_new(unsigned int nbufs, size_t size, size_t controllen)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct io_uring_buf_ring *br;
+	struct uring *u;
+	u_int32_t *array;
+	unsigned int i;
+
+	if (nbufs == 0 || nbufs > 32768 || (nbufs & (nbufs - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		return NULL;
+	u->efd = -1;
+
+	bzero(&p, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ;
+	if ((u->fd = syscall(__NR_io_uring_setup, URING_SQ, &p)) == -1)
+		goto fail;
+	if ((p.features & IORING_FEAT_NODROP) == 0 ||
+	    (p.features & IORING_FEAT_REG_REG_RING) == 0) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	u->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+	u->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(*u->cqes);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sqmaplen = u->cqmaplen = MAX(u->sqmaplen, u->cqmaplen);
+	if ((u->sqmap = uring_map(u->fd, u->sqmaplen,
+	    IORING_OFF_SQ_RING)) == NULL)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cqmap = u->sqmap;
+	else if ((u->cqmap = uring_map(u->fd, u->cqmaplen,
+	    IORING_OFF_CQ_RING)) == NULL)
+		goto fail;
+	u->sqeslen = p.sq_entries * sizeof(*u->sqes);
+	if ((u->sqes = uring_map(u->fd, u->sqeslen, IORING_OFF_SQES)) == NULL)
+		goto fail;
+
+	u->sqhead = (u_int32_t *)((char *)u->sqmap + p.sq_off.head);
+	u->sqtail = (u_int32_t *)((char *)u->sqmap + p.sq_off.tail);
+	u->sqflags = (u_int32_t *)((char *)u->sqmap + p.sq_off.flags);
+	u->sqmask = *(u_int32_t *)((char *)u->sqmap + p.sq_off.ring_mask);
+	array = (u_int32_t *)((char *)u->sqmap + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	u->cqhead = (u_int32_t *)((char *)u->cqmap + p.cq_off.head);
+	u->cqtail = (u_int32_t *)((char *)u->cqmap + p.cq_off.tail);
+	u->cqmask = *(u_int32_t *)((char *)u->cqmap + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+
+	if ((u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	    uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) == -1)
+		goto fail;
+
+	/* A buffer holds the recvmsg header, control, then the datagram. */
+	u->msg.msg_controllen = controllen;
+	u->bufsize = (sizeof(struct io_uring_recvmsg_out) + controllen +
+	    size + 63) & ~(size_t)63;
+	u->nbufs = nbufs;
+	u->bufslen = nbufs * u->bufsize;
+	if ((u->bufs = mmap(NULL, u->bufslen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		u->bufs = NULL;
+		goto fail;
+	}
+	u->brlen = nbufs * sizeof(struct io_uring_buf);
+	if ((br = mmap(NULL, u->brlen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		goto fail;
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = nbufs;
+	reg.bgid = URING_BGID;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(br, u->brlen);
+		goto fail;
+	}
+	u->br = br;
+	for (i = 0; i < nbufs; i++)
+		uring_put(u, i);
+	return u;
+
+fail:
+	uring_free(u);
+	return NULL;
+}
+
+/*
+ * Cancel what is in flight and wait for it, so that nothing lands in
+ * the buffers once they are gone, then tear down.  The cancel counts
+ * the requests it hit; each of them ends with -ECANCELED, before or
+ * after it.  Completions not yet taken are dropped.  Keeps errno.
+ */
+void
+uring_free(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_event ev;
+	int error = errno, ncancel = -1, nended = 0;
+
+	if (u->br != NULL && (sqe = uring_sqe(u)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY |
+		    IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = URING_UD_FINI;
+		if (uring_submit(u) == 0) {
+			while (ncancel == -1 || nended < ncancel) {
+				if (uring_get(u, &ev)) {
+					if (ev.ud == URING_UD_FINI) {
+						if (ev.res < 0)
+							break;
+						ncancel = ev.res;
+					} else if (!ev.more &&
+					    ev.res == -ECANCELED)
+						nended++;
+					continue;
+				}
+				if (uring_enter(u->fd, 0, 1,
+				    IORING_ENTER_GETEVENTS) == -1 &&
+				    errno != EINTR)
+					break;
+			}
+		}
+	}
+	if (u->fd != -1)
+		close(u->fd);
+	if (u->efd != -1)
+		close(u->efd);
+	if (u->br != NULL)
+		munmap(u->br, u->brlen);
+	if (u->bufs != NULL)
+		munmap(u->bufs, u->bufslen);
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqeslen);
+	if (u->cqmap != NULL && u->cqmap != u->sqmap)
+		munmap(u->cqmap, u->cqmaplen);
+	if (u->sqmap != NULL)
+		munmap(u->sqmap, u->sqmaplen);
+	free(u);
+	errno = error;
+}
+
+/*
+ * The eventfd to wait on for completions.  Read it before taking them.
+ */
+int
+uring_fd(struct uring *u)
+{
+	return u->efd;
+}
+
+/*
+ * Accept on listening socket fd until cancelled or failing.  Accepted
+ * descriptors are non-blocking and close-on-exec.
+ */
+int
+uring_accept(struct uring *u, int fd, u_int64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(u)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ud;
+	return uring_submit(u);
+}
+
+/*
+ * Receive datagrams from fd until cancelled, EOF or error, each into a
+ * buffer of the ring.  It also ends, with -ENOBUFS, if the buffers run
+ * out; the datagrams wait on the socket for it to be submitted again.
+ */
+int
+uring_recvmsg(struct uring *u, int fd, u_int64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(u)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&u->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->msg_flags = MSG_CMSG_CLOEXEC;
+	sqe->user_data = ud;
+	return uring_submit(u);
+}
+
+/*
+ * Cancel the request of ud.  It completes, -ECANCELED unless it ended
+ * first; the cancel itself completes with URING_UD_NONE.
+ */
+int
+uring_cancel(struct uring *u, u_int64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(u)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ud;
+	sqe->user_data = URING_UD_NONE;
+	return uring_submit(u);
+}
+
+/*
+ * Take the next completion.  Returns 0 if there is none.  A buffer it
+ * filled is the caller's until uring_put().
+ */
+int
+uring_get(struct uring *u, struct uring_event *ev)
+{
+	struct io_uring_cqe *cqe;
+	u_int32_t head = *u->cqhead;
+
+	if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+		/* What the ring had no room for waits in the kernel. */
+		if ((__atomic_load_n(u->sqflags, __ATOMIC_RELAXED) &
+		    IORING_SQ_CQ_OVERFLOW) == 0)
+			return 0;
+		(void)uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+		if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+	cqe = &u->cqes[head & u->cqmask];
+	ev->ud = cqe->user_data;
+	ev->res = cqe->res;
+	ev->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	ev->bid = (cqe->flags & IORING_CQE_F_BUFFER) ?
+	    (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	__atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Locate the datagram of a receive completion: msg gets its control
+ * messages and flags, buf and len the payload.  msg is set even on
+ * failure, so that passed descriptors can be closed.  Returns -1 if
+ * the datagram was cut short.
+ */
+int
+uring_msg(struct uring *u, struct uring_event *ev, struct msghdr *msg,
+    void **buf, size_t *len)
+{
+	struct io_uring_recvmsg_out *out;
+	size_t hdr = sizeof(*out) + u->msg.msg_controllen;
+	char *p;
+
+	bzero(msg, sizeof(*msg));
+	if (ev->bid < 0 || (unsigned int)ev->bid >= u->nbufs ||
+	    ev->res < 0 || (size_t)ev->res < hdr) {
+		errno = EINVAL;
+		return -1;
+	}
+	p = u->bufs + (size_t)ev->bid * u->bufsize;
+	out = (struct io_uring_recvmsg_out *)p;
+	msg->msg_control = p + sizeof(*out);
+	msg->msg_controllen = MIN(out->controllen, u->msg.msg_controllen);
+	msg->msg_flags = out->flags;
+	*buf = p + hdr;
+	*len = MIN(out->payloadlen, ev->res - hdr);
+	if (out->flags & MSG_TRUNC) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Give buffer bid back to the ring.
+ */
+void
+uring_put(struct uring *u, int bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->brtail & (u->nbufs - 1)];
+
+	b->addr = (uintptr_t)(u->bufs + (size_t)bid * u->bufsize);
+	b->len = u->bufsize;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, ++u->brtail, __ATOMIC_RELEASE);
+}
+
+static int
+uring_enter(int fd, u_int32_t submit, u_int32_t min, u_int32_t flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, min, flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, u_int32_t op, void *arg, u_int32_t n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void *
+uring_map(int fd, size_t len, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    fd, off);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe = &u->sqes[*u->sqtail & u->sqmask];
+
+	bzero(sqe, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Submit the entry just filled in.  If the kernel takes none, as when
+ * completions are backed up, it is withdrawn, which keeps the ring
+ * empty between calls.
+ */
+static int
+uring_submit(struct uring *u)
+{
+	u_int32_t tail = *u->sqtail;
+	int n;
+
+	__atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+	while ((n = uring_enter(u->fd, 1, 0, 0)) == -1 && errno == EINTR)
+		continue;
+	if (n == 1)
+		return 0;
+	if (__atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) == tail)
+		__atomic_store_n(u->sqtail, tail, __ATOMIC_RELEASE);
+	if (n == 0)
+		errno = EAGAIN;
+	return -1;
+}
+
+#else /* !io_uring */
+
+struct uring *
+uring_new(unsigned int nbufs, size_t size, size_t controllen)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+uring_free(struct uring *u)
+{
+}
+
+int
+uring_fd(struct uring *u)
+{
+	return -1;
+}
+
+int
+uring_accept(struct uring *u, int fd, u_int64_t ud)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+uring_recvmsg(struct uring *u, int fd, u_int64_t ud)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+uring_cancel(struct uring *u, u_int64_t ud)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+uring_get(struct uring *u, struct uring_event *ev)
+{
+	return 0;
+}
+
+int
+uring_msg(struct uring *u, struct uring_event *ev, struct msghdr *msg,
+    void **buf, size_t *len)
+{
+	bzero(msg, sizeof(*msg));
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+uring_put(struct uring *u, int bid)
+{
+}
+
+#endif /* io_uring */
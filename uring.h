@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016 Masao Uebayashi <uebayasi@tombiinc.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ICTRL_URING_H_
+#define _ICTRL_URING_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Just enough of Linux io_uring for a server: multishot accept, and
+ * multishot recvmsg into a ring of provided buffers, so that a busy
+ * socket needs one submission for its lifetime instead of a readiness
+ * wakeup and a receive call per batch.  Completions are announced on
+ * an eventfd, to be waited on with the rest of the event loop.  Only
+ * one thread at a time may use a uring.  Elsewhere uring_new() fails
+ * with ENOSYS.
+ */
+struct uring;
+
+#define	URING_UD_NONE		0	/* of cancels; not for requests */
+
+/* A completion. */
+struct uring_event {
+	u_int64_t		 ud;	/* of the request */
+	int			 res;	/* result; -errno on failure */
+	int			 more;	/* a multishot request goes on */
+	int			 bid;	/* buffer filled; -1 if none */
+};
+
+struct uring	*uring_new(unsigned int, size_t, size_t);
+void		 uring_free(struct uring *);
+int		 uring_fd(struct uring *);
+int		 uring_accept(struct uring *, int, u_int64_t);
+int		 uring_recvmsg(struct uring *, int, u_int64_t);
+int		 uring_cancel(struct uring *, u_int64_t);
+int		 uring_get(struct uring *, struct uring_event *);
+int		 uring_msg(struct uring *, struct uring_event *,
+		    struct msghdr *, void **, size_t *);
+void		 uring_put(struct uring *, int);
+
+#endif /* _ICTRL_URING_H_ */